@@ -1,22 +1,59 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "clang/AST/ODRHash.h"
+#include "clang/AST/ParentMapContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Basic/CharInfo.h"
+#include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendActions.h"
 // Declares llvm::cl::extrahelp.
 #include "llvm/Support/CommandLine.h"
 #include "clang/Driver/Options.h"
+#include "clang/Format/Format.h"
 #include "llvm/Option/OptTable.h"
 
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/Tooling/CommonOptionsParser.h"
+#include "clang/Tooling/ReplacementsYaml.h"
 #include "clang/Tooling/Tooling.h"
 #include "clang/Tooling/Transformer/RewriteRule.h"
 #include "clang/Tooling/Transformer/RangeSelector.h"
 #include "clang/Tooling/Transformer/Stencil.h"
 #include "clang/Tooling/Transformer/Transformer.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
 
 
 using namespace clang;
@@ -28,20 +65,334 @@ using namespace clang::driver;
 
 #define DEBUG false
 
+// Apply a custom category to all command-line options so that they are the
+// only ones displayed.
+static cl::OptionCategory ReCondCategory("rewritecond options");
+
+// CommonOptionsParser declares HelpMessage with a description of the common
+// command-line options related to the compilation database and input files.
+// It's nice to have this help message in all tools.
+static cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
+
+// A help message for this specific tool can be added afterwards.
+static cl::extrahelp MoreHelp("\nFor rewriting conditionals into assignments ...\n");
+
+// more options
+static const opt::OptTable &Options = getDriverOptTable();
+static cl::opt<std::string>
+    OutputFileName("o",
+               cl::desc(Options.getOptionHelpText(options::OPT_o)),
+               cl::value_desc("file"),
+               cl::cat(ReCondCategory));
+
+
+static cl::opt<bool>
+    InPlace("i",
+            cl::desc("Rewrite every touched file in place"),
+            cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    OutDir("out-dir",
+           cl::desc("Write every rewritten file to the same relative path under this directory; "
+                    "files whose content would not change are left untouched"),
+           cl::value_desc("dir"),
+           cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    SourceRoot("source-root",
+               cl::desc("Root of the input tree mirrored by --out-dir (default: the current "
+                        "directory)"),
+               cl::value_desc("dir"),
+               cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    ExportFixesDir("export-fixes-dir",
+                   cl::desc("Do not apply the changes; write one clang-apply-replacements YAML "
+                            "file per source to this directory as soon as it is processed"),
+                   cl::value_desc("dir"),
+                   cl::cat(ReCondCategory));
+
+static cl::opt<bool>
+    Serve("serve",
+          cl::desc("Keep running and answer one JSON request per line on stdin, e.g. "
+                   "{\"file\": \"a.c\", \"out\": \"/tmp/a.c\"}"),
+          cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    ServeSocket("serve-socket",
+                cl::desc("Like --serve, but accept connections on this Unix domain socket"),
+                cl::value_desc("path"),
+                cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    Shard("shard",
+          cl::desc("Process only shard i (0-based) of N. Sources are spread over the shards by "
+                   "file size, the same way in every shard; implies --naming=stable"),
+          cl::value_desc("i/N"),
+          cl::cat(ReCondCategory));
+
+static cl::opt<unsigned>
+    Jobs("j",
+         cl::desc("Number of source files to process in parallel (0 = one per core)"),
+         cl::value_desc("N"),
+         cl::init(1),
+         cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    CacheDir("cache-dir",
+             cl::desc("Directory of cached per-file changes; unchanged files are not re-parsed"),
+             cl::value_desc("dir"),
+             cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    PCHHeader("pch",
+              cl::desc("Prefix header with the includes shared by all TUs. It is precompiled "
+                       "once per distinct set of compile flags and loaded into every TU with "
+                       "-include-pch; only main files are rewritten in this mode"),
+              cl::value_desc("header"),
+              cl::cat(ReCondCategory));
+
+static cl::list<std::string>
+    HeaderFilter("header-filter",
+                 cl::desc("Headers to rewrite besides the main file: path prefixes, or globs "
+                          "if they contain *, ? or [. Relative entries are resolved against "
+                          "the current directory. Ignored with --pch"),
+                 cl::value_desc("prefix-or-glob,..."),
+                 cl::CommaSeparated,
+                 cl::cat(ReCondCategory));
+
+static cl::list<std::string>
+    FunctionsInclude("functions-include",
+                     cl::desc("Only rewrite conditions in functions whose qualified name matches "
+                              "this glob, or regex if prefixed with re:. May be repeated"),
+                     cl::value_desc("glob-or-re:regex"),
+                     cl::cat(ReCondCategory));
+
+static cl::list<std::string>
+    FunctionsExclude("functions-exclude",
+                     cl::desc("Do not rewrite conditions in functions whose qualified name "
+                              "matches this glob or re: regex; wins over --functions-include. "
+                              "May be repeated"),
+                     cl::value_desc("glob-or-re:regex"),
+                     cl::cat(ReCondCategory));
+
+static cl::list<std::string>
+    Profiles("profile",
+             cl::desc("Line execution counts of the original program: lcov tracefiles (e.g. "
+                      "from `llvm-cov export -format=lcov` or lcov) or .gcov files. Conditions "
+                      "on lines executed at least --hot-threshold times are not rewritten"),
+             cl::value_desc("file,..."),
+             cl::CommaSeparated,
+             cl::cat(ReCondCategory));
+
+static cl::opt<unsigned long long>
+    HotThreshold("hot-threshold",
+                 cl::desc("Execution count from which a line is hot under --profile"),
+                 cl::value_desc("N"),
+                 cl::init(1000000),
+                 cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    DiffFile("diff",
+             cl::desc("Unified diff (e.g. `git diff -U0`); only conditions on the lines it adds "
+                      "or removes are rewritten, and sources it does not touch are not parsed. "
+                      "Relative paths are resolved against --source-root"),
+             cl::value_desc("file"),
+             cl::cat(ReCondCategory));
+
+static cl::list<std::string>
+    LineRanges("line-ranges",
+               cl::desc("Like --diff, with the changed lines given directly; combines with --diff"),
+               cl::value_desc("file:first-last,..."),
+               cl::CommaSeparated,
+               cl::cat(ReCondCategory));
+
+enum class FormatMode { All, Edits, None };
+
+static cl::opt<FormatMode>
+    FormatScope("format",
+                cl::desc("How much of each rewritten file clang-format processes"),
+                cl::values(
+                    clEnumValN(FormatMode::All, "all",
+                               "format the changed code with the whole file as context (default)"),
+                    clEnumValN(FormatMode::Edits, "edits",
+                               "format the changed lines within their enclosing top-level "
+                               "declarations only; cost scales with the number of edits"),
+                    clEnumValN(FormatMode::None, "none",
+                               "do not run clang-format at all; inserted code is laid out by "
+                               "the rules themselves")),
+                cl::init(FormatMode::All),
+                cl::cat(ReCondCategory));
+
+enum class ApplyMode { Replacements, Linear };
+
+static cl::opt<ApplyMode>
+    ApplyEngine("apply",
+                cl::desc("How changes are applied to each file"),
+                cl::values(
+                    clEnumValN(ApplyMode::Replacements, "replacements",
+                               "merge them through tooling::Replacements (default)"),
+                    clEnumValN(ApplyMode::Linear, "linear",
+                               "sort all edits once and build the file in one pass; a change "
+                               "that overlaps an earlier one is dropped instead of failing "
+                               "the whole file")),
+                cl::init(ApplyMode::Replacements),
+                cl::cat(ReCondCategory));
+
+enum class CaptureMode { Local, Hook };
+
+static cl::opt<CaptureMode>
+    Capture("capture",
+            cl::desc("Where condition values go"),
+            cl::values(
+                clEnumValN(CaptureMode::Local, "local",
+                           "into a local variable declared before the statement (default)"),
+                clEnumValN(CaptureMode::Hook, "hook",
+                           "through an inline __fuzzfix_cond(site, cond) call that records them "
+                           "in shared memory; link runtime/fuzzfix_rt.c into the target")),
+            cl::init(CaptureMode::Local),
+            cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    SiteMapFile("site-map",
+                cl::desc("With --capture=hook, write one line per rewritten condition: its site "
+                         "id, its slot in the runtime's table and its file:line"),
+                cl::value_desc("file"),
+                cl::cat(ReCondCategory));
+
+enum class LoopRewrite { Break, Inline };
+
+static cl::opt<LoopRewrite>
+    LoopMode("loop-mode",
+             cl::desc("How while and for loops are rewritten"),
+             cl::values(
+                 clEnumValN(LoopRewrite::Break, "break",
+                            "condition becomes 1, and the body starts by capturing it and "
+                            "breaking out of the loop if it is false (default)"),
+                 clEnumValN(LoopRewrite::Inline, "inline",
+                            "capture in place, `while ((__fuzzfixN = cond))`, keeping the loop in "
+                            "canonical form so the compiler can still analyze and vectorize it")),
+             cl::init(LoopRewrite::Break),
+             cl::cat(ReCondCategory));
+
+enum class NamingMode { Counter, Stable };
+
+static cl::opt<NamingMode>
+    Naming("naming",
+           cl::desc("How condition variables are named"),
+           cl::values(
+               clEnumValN(NamingMode::Counter, "counter",
+                          "__fuzzfix<N>, numbered in match order (default)"),
+               clEnumValN(NamingMode::Stable, "stable",
+                          "derived from the enclosing function and the condition, so that "
+                          "unchanged code is rewritten to identical text")),
+           cl::init(NamingMode::Counter),
+           cl::cat(ReCondCategory));
+
+enum class EngineMode { Matchers, Visitor };
+
+static cl::opt<EngineMode>
+    Engine("engine",
+           cl::desc("How conditionals are found"),
+           cl::values(
+               clEnumValN(EngineMode::Matchers, "matchers",
+                          "AST matchers with parent lookups (default)"),
+               clEnumValN(EngineMode::Visitor, "visitor",
+                          "a single pass of one AST visitor that tracks parents while it "
+                          "descends, so no parent map is built; emits the same edits")),
+           cl::init(EngineMode::Matchers),
+           cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    StatsFile("stats",
+              cl::desc("Write a JSON report: wall and CPU time per phase, matches per rule, "
+                       "edits per file, failed changes and per-TU times"),
+              cl::value_desc("file"),
+              cl::cat(ReCondCategory));
+
+static cl::opt<std::string>
+    TimeTraceFile("time-trace",
+                  cl::desc("Write a Chrome trace-event timeline (chrome://tracing, Perfetto) "
+                           "with one track per worker thread"),
+                  cl::value_desc("file"),
+                  cl::cat(ReCondCategory));
+
+static cl::opt<unsigned>
+    TimeTraceGranularity("time-trace-granularity",
+                         cl::desc("Minimum duration in microseconds of a traced event"),
+                         cl::init(500),
+                         cl::cat(ReCondCategory));
+
+
+// All per-TU state below is thread_local and reset at the start of each translation unit
+// (see RewriteCondAction), so that `-j` workers never share counters or changes.
+
 // keeps track of how many changes have been made so far
-static int changes_count = 0;
+static thread_local int changes_count = 0;
+// edits the rules could not produce
+static thread_local int failed_changes = 0;
 
 // for generating names
 static std::string var_base = "__fuzzfix";
-static int new_var_count = 0;
+static thread_local int new_var_count = 0;
+static thread_local std::string current_var;
+
+// for stable names: how often each (function, condition) key has been seen in this TU,
+// to tell apart identical conditions within one function
+static thread_local std::map<std::string, int> stable_key_count;
+
+// the function the visitor engine is currently inside, which saves a walk up the parent map
+static thread_local const FunctionDecl *current_function = nullptr;
+
+static const FunctionDecl *enclosing_function(ASTContext &Ctx, const Stmt *S) {
+    DynTypedNode Node = DynTypedNode::create(*S);
+    while (true) {
+        auto Parents = Ctx.getParents(Node);
+        if (Parents.empty())
+            return nullptr;
+        Node = Parents[0];
+        if (const auto *FD = Node.get<FunctionDecl>())
+            return FD;
+    }
+}
+
+/**
+ * Name built from the enclosing function and a structural (ODR) hash of the condition.
+ * It does not depend on how many conditions were rewritten before this one, so edits
+ * elsewhere in the file leave it unchanged.
+ */
+static std::string stable_var_name(const MatchFinder::MatchResult &R, StringRef cond_id) {
+    const Expr *Cond = R.Nodes.getNodeAs<Expr>(cond_id);
+
+    std::string Func = "global";
+    const FunctionDecl *FD = Engine == EngineMode::Visitor ? current_function
+                                                           : enclosing_function(*R.Context, Cond);
+    if (FD) {
+        Func = FD->getQualifiedNameAsString();
+        for (char &c : Func)
+            if (!isAlphanumeric(c)) c = '_';
+    }
+    ODRHash Hash;
+    Hash.AddStmt(Cond);
+    char HashHex[9];
+    snprintf(HashHex, sizeof(HashHex), "%08x", Hash.CalculateHash());
+
+    std::string Key = Func + "_" + HashHex;
+    int Seen = stable_key_count[Key]++;
+    return var_base + "_" + Key + (Seen ? "_" + std::to_string(Seen) : "");
+}
 
 std::string get_var_only() {
-    return var_base + std::to_string(new_var_count);
+    return current_var;
 }
 
-std::string get_var_and_inc() {
+std::string get_var_and_inc(const MatchFinder::MatchResult &R, StringRef cond_id) {
     new_var_count++;
-    return get_var_only();
+    if (Naming == NamingMode::Stable && R.Nodes.getNodeAs<Expr>(cond_id))
+        current_var = stable_var_name(R, cond_id);
+    else
+        current_var = var_base + std::to_string(new_var_count);
+    return current_var;
 }
 
 // for binding ast nodes
@@ -60,6 +411,74 @@ static StringRef for_cond = "for_cond";
 static StringRef for_body_compound = "for_body_compound";
 static StringRef for_body_single = "for_body_single";
 
+// for laying out inserted code: stencils below indent every line they add themselves, so the
+// output stays readable even when no formatter runs afterwards (--format=none). Closing braces
+// are the exception: nested statements can end at the same offset, and their closers only merge
+// if they are the same text, so they are a bare "\n}" indented later by indent_closers().
+static const char *indent_unit = "    ";
+
+static std::string line_indent(const SourceManager &SM, SourceLocation Loc) {
+    std::pair<FileID, unsigned> Pos = SM.getDecomposedLoc(SM.getExpansionLoc(Loc));
+    bool Invalid = false;
+    StringRef Buffer = SM.getBufferData(Pos.first, &Invalid);
+    if (Invalid)
+        return "";
+    size_t Begin = Buffer.rfind('\n', Pos.second) + 1; // npos + 1 == 0 on the first line
+    size_t End = Begin;
+    while (End < Buffer.size() && (Buffer[End] == ' ' || Buffer[End] == '\t'))
+        End++;
+    return Buffer.slice(Begin, End).str();
+}
+
+// indentation of the line the node bound to `id` starts on
+static Stencil indent(StringRef id) {
+    std::string Id = id.str();
+    return run([Id](const MatchFinder::MatchResult &R) -> Expected<std::string> {
+        const Stmt *S = R.Nodes.getNodeAs<Stmt>(Id);
+        return S ? line_indent(*R.SourceManager, S->getBeginLoc()) : "";
+    });
+}
+
+// Indentation for lines added at the top of the body bound to `body_id`: that of its first
+// statement if it has a line of its own, otherwise one level deeper than the statement `stmt_id`.
+static Stencil body_indent(StringRef stmt_id, StringRef body_id) {
+    std::string StmtId = stmt_id.str(), BodyId = body_id.str();
+    return run([StmtId, BodyId](const MatchFinder::MatchResult &R) -> Expected<std::string> {
+        const SourceManager &SM = *R.SourceManager;
+        const Stmt *S = R.Nodes.getNodeAs<Stmt>(StmtId);
+        const Stmt *Body = R.Nodes.getNodeAs<Stmt>(BodyId);
+        if (!S || !Body)
+            return "";
+        SourceLocation Anchor = S->getBeginLoc();
+        const Stmt *First = Body;
+        if (const auto *CS = dyn_cast<CompoundStmt>(Body)) {
+            Anchor = CS->getLBracLoc();
+            First = CS->body_empty() ? nullptr : CS->body_front();
+        }
+        if (First && SM.getExpansionLineNumber(First->getBeginLoc()) !=
+                         SM.getExpansionLineNumber(Anchor))
+            return line_indent(SM, First->getBeginLoc());
+        return line_indent(SM, S->getBeginLoc()) + indent_unit;
+    });
+}
+
+
+// the `)` that closes the header of the loop bound to `id`
+static RangeSelector rparen(StringRef id) {
+    std::string Id = id.str();
+    return [Id](const MatchFinder::MatchResult &R) -> Expected<CharSourceRange> {
+        const Stmt *S = R.Nodes.getNodeAs<Stmt>(Id);
+        SourceLocation Loc;
+        if (const auto *While = dyn_cast_or_null<WhileStmt>(S))
+            Loc = While->getRParenLoc();
+        else if (const auto *For = dyn_cast_or_null<ForStmt>(S))
+            Loc = For->getRParenLoc();
+        if (Loc.isInvalid())
+            return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                           "no loop header bound to " + Id);
+        return CharSourceRange::getTokenRange(Loc, Loc);
+    };
+}
 
 /**************** Rules ****************/
 
@@ -92,7 +511,8 @@ static RewriteRule else_if_rule = makeRule(
         // declare the init cond variable
         insertBefore(
             statement(std::string(if_stmt)),
-            cat("{\nint ", run([](auto x) {return get_var_and_inc();}), " = ", expression(if_cond), ";\n")
+            cat("{\n", indent(if_stmt), "int ", run([](const auto &R) {return get_var_and_inc(R, if_cond);}), " = ", expression(if_cond), ";\n",
+                indent(if_stmt))
         ),
         // replace cond expr with cond variable
         changeTo(
@@ -129,7 +549,8 @@ static RewriteRule case_if_rule = makeRule(
         insertBefore(
             statement(std::string(if_stmt)),
             // only diff to normal `if`: add `;` before declaration
-            cat(";\nint ", run([](auto x) {return get_var_and_inc();}), " = ", expression(if_cond), ";\n")
+            cat(";\n", indent(if_stmt), "int ", run([](const auto &R) {return get_var_and_inc(R, if_cond);}), " = ", expression(if_cond), ";\n",
+                indent(if_stmt))
         ),
         // replace cond expr with cond variable
         changeTo(
@@ -157,7 +578,8 @@ static RewriteRule if_rule = makeRule(
         // declare the init cond variable
         insertBefore(
             statement(std::string(if_stmt)),
-            cat("int ", run([](auto x) {return get_var_and_inc();}), " = ", expression(if_cond), ";\n")
+            cat("int ", run([](const auto &R) {return get_var_and_inc(R, if_cond);}), " = ", expression(if_cond), ";\n",
+                indent(if_stmt))
         ),
         // replace cond expr with cond variable
         changeTo(
@@ -193,8 +615,10 @@ static RewriteRule while_rule = makeRule(
             statements(std::string(while_body_compound)),
             cat(
                 // declare and init cond variable
-                "\nint ", run([](auto x) {return get_var_and_inc();}), " = ", expression(while_cond), ";\n",
+                "\n", body_indent(while_stmt, while_body_compound),
+                "int ", run([](const auto &R) {return get_var_and_inc(R, while_cond);}), " = ", expression(while_cond), ";\n",
                 // insert break conditioned upon value of cond variable
+                body_indent(while_stmt, while_body_compound),
                 "if (!", run([](auto x) {return get_var_only();}), ") break;"
             )
         )
@@ -225,13 +649,17 @@ static RewriteRule while_rule_single = makeRule(
             node(std::string(while_cond)),
             cat("1")
         ),
-        insertBefore(
-            statement(std::string(while_body_single)),
+        // open the block at the `)`, not before the body: a rule matching the body inserts
+        // there itself, and two different insertions at one offset conflict
+        changeTo(
+            rparen(while_stmt),
             cat(
                 // declare and init cond variable
-                "{\nint ", run([](auto x) {return get_var_and_inc();}), " = ", expression(while_cond), ";\n",
+                ") {\n", body_indent(while_stmt, while_body_single),
+                "int ", run([](const auto &R) {return get_var_and_inc(R, while_cond);}), " = ", expression(while_cond), ";\n",
                 // insert break conditioned upon value of cond variable
-                "if (!", run([](auto x) {return get_var_only();}), ") break;\n"
+                body_indent(while_stmt, while_body_single),
+                "if (!", run([](auto x) {return get_var_only();}), ") break;"
             )
         ),
         // for single stmt body, still need to insert }
@@ -270,8 +698,10 @@ static RewriteRule for_rule = makeRule(
             statements(std::string(for_body_compound)),
             cat(
                 // declare and init cond variable
-                "\nint ", run([](auto x) {return get_var_and_inc();}), " = ", expression(for_cond), ";\n",
+                "\n", body_indent(for_stmt, for_body_compound),
+                "int ", run([](const auto &R) {return get_var_and_inc(R, for_cond);}), " = ", expression(for_cond), ";\n",
                 // insert break conditioned upon value of cond variable
+                body_indent(for_stmt, for_body_compound),
                 "if (!", run([](auto x) {return get_var_only();}), ") break;"
             )
         )
@@ -297,13 +727,17 @@ static RewriteRule for_rule_single = makeRule(
             node(std::string(for_cond)),
             cat("1")
         ),
-        insertBefore(
-            statement(std::string(for_body_single)),
+        // open the block at the `)`, not before the body: a rule matching the body inserts
+        // there itself, and two different insertions at one offset conflict
+        changeTo(
+            rparen(for_stmt),
             cat(
                 // declare and init cond variable
-                "{\nint ", run([](auto x) {return get_var_and_inc();}), " = ", expression(for_cond), ";\n",
+                ") {\n", body_indent(for_stmt, for_body_single),
+                "int ", run([](const auto &R) {return get_var_and_inc(R, for_cond);}), " = ", expression(for_cond), ";\n",
                 // insert break conditioned upon value of cond variable
-                "if (!", run([](auto x) {return get_var_only();}), ") break;\n"
+                body_indent(for_stmt, for_body_single),
+                "if (!", run([](auto x) {return get_var_only();}), ") break;"
             )
         ),
         // for single stmt body, still need to insert }
@@ -314,6 +748,44 @@ static RewriteRule for_rule_single = makeRule(
     }
 );
 
+/**
+ * --loop-mode=inline: the same match as a loop rule, but the condition is captured where it is
+ * evaluated. The variable is declared in a block around the loop, which keeps the loop itself,
+ * its exit test and its trip count as they were:
+ *   { int __fuzzfixN;
+ *   while ((__fuzzfixN = cond)) ... }
+ * A single-statement body bound to body_id gets braces as in break mode, since a rule matching
+ * the body may put a declaration in front of it.
+ */
+static RewriteRule inlined_loop(const RewriteRule &Rule, StringRef stmt_id, StringRef cond_id,
+                                StringRef body_id) {
+    SmallVector<ASTEdit, 1> Edits = {
+        // declare the cond variable
+        insertBefore(
+            statement(std::string(stmt_id)),
+            cat("{\n", indent(stmt_id),
+                "int ", run([cond_id](const auto &R) {return get_var_and_inc(R, cond_id);}), ";\n",
+                indent(stmt_id))
+        ),
+        // assign it where the cond is evaluated
+        changeTo(
+            node(std::string(cond_id)),
+            cat("(", run([](auto x) {return get_var_only();}), " = ", expression(std::string(cond_id)), ")")
+        ),
+        // a bare closer, like the other rules', so that nested loops ending together merge
+        insertAfter(
+            statement(std::string(stmt_id)),
+            cat("\n}")
+        )
+    };
+    if (!body_id.empty()) {
+        // open the block at the `)`, as the single-statement rules do
+        Edits.push_back(changeTo(rparen(stmt_id), cat(") {")));
+        Edits.push_back(insertAfter(statement(std::string(body_id)), cat("\n}")));
+    }
+    return makeRule(Rule.Cases[0].Matcher, std::move(Edits));
+}
+
 // order is important, since the matching is done from first to last
 static auto rules = applyFirst({
     else_if_rule,
@@ -325,32 +797,144 @@ static auto rules = applyFirst({
     for_rule_single
 });
 
+// names of the rules above, in the same order, for --stats
+static const std::vector<std::string> rule_names = {
+    "else_if_rule",
+    "case_if_rule",
+    "if_rule",
+    "while_rule",
+    "while_rule_single",
+    "for_rule",
+    "for_rule_single"
+};
+
 /**************** Rules END ****************/
 
 
-// Apply a custom category to all command-line options so that they are the
-// only ones displayed.
-static cl::OptionCategory ReCondCategory("rewritecond options");
+/**************** Runtime hooks ****************/
 
-// CommonOptionsParser declares HelpMessage with a description of the common
-// command-line options related to the compilation database and input files.
-// It's nice to have this help message in all tools.
-static cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
+// With --capture=hook, the condition is passed through a call into runtime/fuzzfix_rt.h instead
+// of being stored in a local variable, so the fuzzer can read its value from shared memory.
+static const char *hook_include = "#include \"fuzzfix_rt.h\"\n";
 
-// A help message for this specific tool can be added afterwards.
-static cl::extrahelp MoreHelp("\nFor rewriting conditionals into assignments ...\n");
+/**
+ * Identifies a condition across the whole program: its file name and its stable key (enclosing
+ * function, structural hash, occurrence), hashed to 32 bits. Like stable names, it survives
+ * unrelated edits to the file.
+ */
+static std::string site_id(const MatchFinder::MatchResult &R, StringRef cond_id) {
+    const Expr *Cond = R.Nodes.getNodeAs<Expr>(cond_id);
+    const SourceManager &SM = *R.SourceManager;
+    std::string Key = llvm::sys::path::filename(
+                          SM.getFilename(SM.getExpansionLoc(Cond->getBeginLoc()))).str();
+    Key += ":" + stable_var_name(R, cond_id);
+    char Id[16];
+    snprintf(Id, sizeof(Id), "0x%08xu", static_cast<uint32_t>(xxHash64(Key)));
+    return Id;
+}
 
-// more options
-static const opt::OptTable &Options = getDriverOptTable();
-static cl::opt<std::string>
-    OutputFileName("o",
-               cl::desc(Options.getOptionHelpText(options::OPT_o)),
-               cl::value_desc("file"),
-               cl::cat(ReCondCategory));
+// The same match as Rule, with the condition wrapped in a hook call as the only edit. The hook
+// takes the truth value, so pointer, long and class-type conditions are not narrowed to int.
+static RewriteRule hooked(const RewriteRule &Rule, StringRef cond_id) {
+    return makeRule(Rule.Cases[0].Matcher,
+                    edit(changeTo(node(std::string(cond_id)),
+                                  cat("__fuzzfix_cond(",
+                                      run([cond_id](const auto &R) {return site_id(R, cond_id);}),
+                                      ", !!(", node(std::string(cond_id)), "))"))));
+}
+
+// FUZZFIX_SITES in runtime/fuzzfix_rt.h: the hook stores the value of site `id` in slot
+// id % hook_slots of its row
+static const uint32_t hook_slots = 65536;
+
+/**
+ * Finds the site ids in the changes about to be applied, warns about sites that share a slot of
+ * the runtime's table (their values overwrite each other) and writes --site-map. Returns false
+ * if the map cannot be written.
+ */
+static bool check_hook_sites(const std::map<std::string, AtomicChanges> &Buckets) {
+    const StringRef Call = "__fuzzfix_cond(0x";
+    // slot -> site id and file:line of every site in it
+    std::map<uint32_t, std::set<std::pair<uint32_t, std::string>>> Slots;
+    for (const auto &Entry : Buckets) {
+        std::unique_ptr<MemoryBuffer> Code;
+        for (const auto &C : Entry.second) {
+            for (const auto &R : C.getReplacements()) {
+                StringRef Text = R.getReplacementText();
+                for (size_t Pos = Text.find(Call); Pos != StringRef::npos;
+                     Pos = Text.find(Call, Pos + 1)) {
+                    uint32_t Id;
+                    if (Text.substr(Pos + Call.size(), 8).getAsInteger(16, Id))
+                        continue;
+                    if (!Code) {
+                        auto Buffer = MemoryBuffer::getFile(Entry.first);
+                        Code = Buffer ? std::move(*Buffer) : MemoryBuffer::getMemBuffer("");
+                    }
+                    size_t Line = 1 + Code->getBuffer().take_front(R.getOffset()).count('\n');
+                    Slots[Id % hook_slots].insert({Id, Entry.first + ":" + std::to_string(Line)});
+                }
+            }
+        }
+    }
+
+    for (const auto &Slot : Slots) {
+        if (Slot.second.size() < 2)
+            continue;
+        llvm::errs() << "warning: hook sites share table slot " << Slot.first << ":";
+        for (const auto &Site : Slot.second)
+            llvm::errs() << " " << llvm::format("0x%08x", Site.first) << " (" << Site.second << ")";
+        llvm::errs() << "\n";
+    }
+
+    if (SiteMapFile.empty())
+        return true;
+    std::error_code EC;
+    raw_fd_ostream OS(SiteMapFile, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        llvm::errs() << "Cannot write " << SiteMapFile << ": " << EC.message() << "\n";
+        return false;
+    }
+    for (const auto &Slot : Slots)
+        for (const auto &Site : Slot.second)
+            OS << llvm::format("0x%08x", Site.first) << " " << Slot.first << " " << Site.second
+               << "\n";
+    return true;
+}
+
+/**************** Runtime hooks END ****************/
+
+
+/**
+ * Rule as applied under the selected --capture and --loop-mode. It binds stmt_id and cond_id;
+ * IsLoop tells the loop rules apart, and body_id names the body of the single-statement ones.
+ */
+static RewriteRule for_modes(const RewriteRule &Rule, StringRef stmt_id, StringRef cond_id,
+                             bool IsLoop, StringRef body_id = "") {
+    if (Capture == CaptureMode::Hook)
+        return hooked(Rule, cond_id);
+    if (IsLoop && LoopMode == LoopRewrite::Inline)
+        return inlined_loop(Rule, stmt_id, cond_id, body_id);
+    return Rule;
+}
+
+// `rules` under the selected modes, in the same order
+static RewriteRule selected_rules() {
+    if (Capture == CaptureMode::Local && LoopMode == LoopRewrite::Break)
+        return rules;
+    return applyFirst({
+        for_modes(else_if_rule, if_stmt, if_cond, false),
+        for_modes(case_if_rule, if_stmt, if_cond, false),
+        for_modes(if_rule, if_stmt, if_cond, false),
+        for_modes(while_rule, while_stmt, while_cond, true),
+        for_modes(while_rule_single, while_stmt, while_cond, true, while_body_single),
+        for_modes(for_rule, for_stmt, for_cond, true),
+        for_modes(for_rule_single, for_stmt, for_cond, true, for_body_single)
+    });
+}
 
 
 // AtomicChange consumer
-static AtomicChanges Changes;
+static thread_local AtomicChanges Changes;
 static void consumer(Expected<AtomicChange> C) {
     if (auto E = C.takeError()) {
         // We must consume the error. Typically one of:
@@ -359,6 +943,7 @@ static void consumer(Expected<AtomicChange> C) {
         // - consumeError(), to silently swallow the error
         // - handleErrors(), to distinguish error types
         llvm::errs() << "Problem with consuming AtomicChange: " << toString(std::move(E)) << "\n";
+        failed_changes++;
         return;
     }
     if (DEBUG) std::cout << "AC #" << changes_count << " : "<< C->toYAMLString() << std::endl;
@@ -367,54 +952,2340 @@ static void consumer(Expected<AtomicChange> C) {
 }
 
 
-int main(int argc, const char **argv) {
-    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ReCondCategory);
-    if (!ExpectedParser) {
-        // Fail gracefully for unsupported options.
-        llvm::errs() << ExpectedParser.takeError();
-        return 1;
+static std::string normalize_path(SmallString<256> Path) {
+    llvm::sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+    return std::string(Path.str());
+}
+
+/**************** Profile ****************/
+
+// --profile: execution counts per line, by absolute normalized path; read-only once loaded
+static llvm::StringMap<llvm::DenseMap<unsigned, uint64_t>> LineCounts;
+// hashes of the loaded profiles, for the cache key
+static std::string ProfileKey;
+
+// profiled lines of each file of the current TU, nullptr for files without a profile
+static thread_local llvm::DenseMap<FileID, const llvm::DenseMap<unsigned, uint64_t> *> tu_profiles;
+// conditions left alone because they are hot
+static thread_local int hot_conditions = 0;
+
+// source paths in a profile may be relative to where it was written
+static std::string profile_source(StringRef ProfilePath, StringRef Source) {
+    SmallString<256> Path(Source);
+    if (!llvm::sys::path::is_absolute(Path)) {
+        Path = llvm::sys::path::parent_path(getAbsolutePath(ProfilePath));
+        llvm::sys::path::append(Path, Source);
     }
-    CommonOptionsParser& OptionsParser = ExpectedParser.get();
-    ClangTool Tool(OptionsParser.getCompilations(),
-                 OptionsParser.getSourcePathList());
+    return normalize_path(Path);
+}
 
-    MatchFinder Finder;
-    clang::tooling::Transformer T(rules, consumer);
-    T.registerMatchers(&Finder);
-    auto Factory = newFrontendActionFactory(&Finder);
-
-    Tool.run(Factory.get());
-
-    std::ifstream in_file(argv[1]);
-    std::stringstream buffer;
-    buffer << in_file.rdbuf();
-    in_file.close();
-
-    auto spec = ApplyChangesSpec();
-    spec.Format = ApplyChangesSpec::kAll;
-    spec.Style = format::getGoogleStyle(format::FormatStyle::LanguageKind::LK_Cpp);
-    auto ChangedCode = applyAtomicChanges(argv[1], buffer.str(), Changes, spec);
-
-    if (!ChangedCode) {
-      llvm::errs() << "Applying changes failed: "
-                   << llvm::toString(ChangedCode.takeError()) << "\n";
-      return 1;
-    }
-
-    // write out result
-    if (!OutputFileName.empty()) { // write to file
-        std::ofstream outfile(OutputFileName);
-        if (outfile.is_open()) {   // can write - good path
-            outfile << ChangedCode.get() << std::endl;
-            outfile.close();
-            std::cerr << "Successfully applied " << changes_count << " changes!" << std::endl;
-            return 0;
+// lcov tracefile: SF:<source>, then DA:<line>,<count>[,<checksum>] records up to end_of_record
+static void load_lcov(StringRef ProfilePath, StringRef Data) {
+    llvm::DenseMap<unsigned, uint64_t> *Counts = nullptr;
+    SmallVector<StringRef, 0> Lines;
+    Data.split(Lines, '\n');
+    for (StringRef Line : Lines) {
+        Line = Line.trim();
+        unsigned LineNo;
+        uint64_t Count;
+        if (Line.consume_front("SF:")) {
+            Counts = &LineCounts[profile_source(ProfilePath, Line)];
+        } else if (Line == "end_of_record") {
+            Counts = nullptr;
+        } else if (Counts && Line.consume_front("DA:")) {
+            StringRef LineField, CountField;
+            std::tie(LineField, CountField) = Line.split(',');
+            CountField = CountField.split(',').first;
+            if (!LineField.getAsInteger(10, LineNo) && !CountField.getAsInteger(10, Count))
+                (*Counts)[LineNo] += Count;
+        }
+    }
+}
+
+// gcov text: "<count>:<line>:<text>", where count is -, ##### or =====, or a number that may be
+// followed by *; line 0 carries the Source: header
+static void load_gcov(StringRef ProfilePath, StringRef Data) {
+    llvm::DenseMap<unsigned, uint64_t> *Counts = nullptr;
+    SmallVector<StringRef, 0> Lines;
+    Data.split(Lines, '\n');
+    for (StringRef Line : Lines) {
+        SmallVector<StringRef, 3> Fields;
+        Line.split(Fields, ':', /*MaxSplit=*/2);
+        if (Fields.size() != 3)
+            continue;
+        StringRef CountField = Fields[0].trim();
+        unsigned LineNo;
+        if (Fields[1].trim().getAsInteger(10, LineNo))
+            continue;
+        if (LineNo == 0) {
+            if (Fields[2].consume_front("Source:"))
+                Counts = &LineCounts[profile_source(ProfilePath, Fields[2].trim())];
+            continue;
+        }
+        uint64_t Count;
+        if (!Counts || CountField == "-" || CountField == "#####" || CountField == "=====")
+            continue;
+        if (!CountField.rtrim('*').getAsInteger(10, Count))
+            (*Counts)[LineNo] += Count;
+    }
+}
+
+// counts of a file listed in several profiles add up
+static bool load_profiles() {
+    for (const std::string &Path : Profiles) {
+        auto Buffer = MemoryBuffer::getFile(Path);
+        if (!Buffer) {
+            llvm::errs() << "Cannot read profile " << Path << ": " << Buffer.getError().message()
+                         << "\n";
+            return false;
+        }
+        StringRef Data = (*Buffer)->getBuffer();
+        if (llvm::sys::path::extension(Path) == ".gcov")
+            load_gcov(Path, Data);
+        else
+            load_lcov(Path, Data);
+        ProfileKey += llvm::utohexstr(xxHash64(Data)) + ",";
+    }
+    return true;
+}
+
+// the condition any of the rules bound
+static const Expr *matched_condition(const MatchFinder::MatchResult &R) {
+    for (StringRef Id : {if_cond, while_cond, for_cond})
+        if (const auto *Cond = R.Nodes.getNodeAs<Expr>(Id))
+            return Cond;
+    return nullptr;
+}
+
+// whether the condition a rule matched is on a line executed at least --hot-threshold times
+static bool hot_condition(const MatchFinder::MatchResult &R) {
+    const Expr *Cond = matched_condition(R);
+    if (!Cond)
+        return false;
+
+    const SourceManager &SM = *R.SourceManager;
+    SourceLocation Loc = SM.getExpansionLoc(Cond->getBeginLoc());
+    if (Loc.isInvalid())
+        return false;
+    FileID FID = SM.getFileID(Loc);
+    auto Cached = tu_profiles.find(FID);
+    if (Cached == tu_profiles.end()) {
+        const llvm::DenseMap<unsigned, uint64_t> *Counts = nullptr;
+        if (const FileEntry *FE = SM.getFileEntryForID(FID)) {
+            SmallString<256> Path(FE->getName());
+            SM.getFileManager().makeAbsolutePath(Path);
+            auto Found = LineCounts.find(normalize_path(Path));
+            if (Found != LineCounts.end())
+                Counts = &Found->second;
+        }
+        Cached = tu_profiles.insert({FID, Counts}).first;
+    }
+    if (!Cached->second)
+        return false;
+    auto Count = Cached->second->find(SM.getExpansionLineNumber(Loc));
+    return Count != Cached->second->end() && Count->second >= HotThreshold;
+}
+
+/**************** Diff ****************/
+
+// inclusive line range
+using LineRange = std::pair<unsigned, unsigned>;
+
+// --diff and --line-ranges: changed lines per absolute normalized path, sorted and merged;
+// read-only once loaded
+static llvm::StringMap<std::vector<LineRange>> ChangedLines;
+// hashes of the loaded diff and ranges, for the cache key
+static std::string DiffKey;
+
+// changed lines of each file of the current TU, nullptr for unchanged files
+static thread_local llvm::DenseMap<FileID, const std::vector<LineRange> *> tu_changed;
+
+static bool diff_active() {
+    return !DiffFile.empty() || !LineRanges.empty();
+}
+
+static std::string diff_source(StringRef File) {
+    SmallString<256> Path(SourceRoot.empty() ? "." : SourceRoot.getValue());
+    llvm::sys::fs::make_absolute(Path);
+    if (llvm::sys::path::is_absolute(File))
+        Path = File;
+    else
+        llvm::sys::path::append(Path, File);
+    return normalize_path(Path);
+}
+
+// "<start>[,<count>]" of a hunk header
+static bool parse_hunk_range(StringRef Field, unsigned &Start, unsigned &Count) {
+    StringRef StartField, CountField;
+    std::tie(StartField, CountField) = Field.split(',');
+    Count = 1;
+    return !StartField.getAsInteger(10, Start) &&
+           (CountField.empty() || !CountField.getAsInteger(10, Count));
+}
+
+/**
+ * Records the lines a unified diff adds in the new files. A removal marks the line that now
+ * follows it, so a condition a line was removed from still counts as changed. Hunk bodies
+ * are delimited by the line counts in their headers, so removed lines that look like
+ * file headers are not mistaken for them.
+ */
+static bool load_diff() {
+    auto Buffer = MemoryBuffer::getFile(DiffFile);
+    if (!Buffer) {
+        llvm::errs() << "Cannot read diff " << DiffFile << ": " << Buffer.getError().message()
+                     << "\n";
+        return false;
+    }
+    StringRef Data = (*Buffer)->getBuffer();
+    // the diff's relative paths depend on the root they are resolved against
+    DiffKey += diff_source("") + ":" + llvm::utohexstr(xxHash64(Data)) + ",";
+
+    std::vector<LineRange> *Ranges = nullptr;
+    // git's a/ and b/ prefixes: whether the current file's paths carry them, whether a
+    // `diff --git` line decided that, and whether the paths of any modified file do
+    bool Prefixed = false, FromGitHeader = false, AnyPrefixed = false;
+    StringRef Source; // the old side of the current file
+    unsigned NewLine = 0, OldLeft = 0, NewLeft = 0;
+    SmallVector<StringRef, 0> Lines;
+    Data.split(Lines, '\n');
+    for (size_t I = 1; I < Lines.size(); I++)
+        if (Lines[I - 1].startswith("--- a/") && Lines[I].startswith("+++ b/"))
+            AnyPrefixed = true;
+    for (StringRef Line : Lines) {
+        if (OldLeft || NewLeft) {
+            char Kind = Line.empty() ? ' ' : Line[0];
+            if (Kind == '+' && NewLeft) {
+                if (Ranges)
+                    Ranges->push_back({NewLine, NewLine});
+                NewLine++;
+                NewLeft--;
+            } else if (Kind == '-' && OldLeft) {
+                if (Ranges)
+                    Ranges->push_back({NewLine, NewLine});
+                OldLeft--;
+            } else if (Kind == ' ' && OldLeft && NewLeft) {
+                NewLine++;
+                OldLeft--;
+                NewLeft--;
+            } else if (Kind != '\\') {
+                llvm::errs() << "Malformed hunk in " << DiffFile << ": " << Line << "\n";
+                return false;
+            }
+            continue;
+        }
+
+        Line = Line.rtrim("\r");
+        if (Line.startswith("diff --git ")) {
+            StringRef Paths = Line.drop_front(strlen("diff --git "));
+            Prefixed = Paths.startswith("a/") && Paths.contains(" b/");
+            FromGitHeader = true;
+        } else if (Line.startswith("--- ")) {
+            // GNU diff appends a tab and the timestamp
+            Source = Line.drop_front(4).split('\t').first;
+        } else if (Line.startswith("+++ ")) {
+            StringRef Target = Line.drop_front(4).split('\t').first;
+            // without a git header, both sides tell; for an added or deleted file, whose other
+            // side is /dev/null, the modified files of the diff do
+            if (!FromGitHeader) {
+                if (Source == "/dev/null")
+                    Prefixed = AnyPrefixed && Target.startswith("b/");
+                else if (Target == "/dev/null")
+                    Prefixed = AnyPrefixed && Source.startswith("a/");
+                else
+                    Prefixed = Source.startswith("a/") && Target.startswith("b/");
+            }
+            FromGitHeader = false;
+            Ranges = nullptr;
+            // a deleted file has no lines left to rewrite
+            if (Target == "/dev/null")
+                continue;
+            if (Prefixed)
+                Target.consume_front("b/");
+            Ranges = &ChangedLines[diff_source(Target)];
+        } else if (Line.startswith("@@ ")) {
+            SmallVector<StringRef, 4> Fields;
+            Line.split(Fields, ' ', /*MaxSplit=*/3);
+            unsigned OldStart, NewStart;
+            if (Fields.size() < 3 || !Fields[1].consume_front("-") ||
+                !Fields[2].consume_front("+") || !parse_hunk_range(Fields[1], OldStart, OldLeft) ||
+                !parse_hunk_range(Fields[2], NewStart, NewLeft)) {
+                llvm::errs() << "Malformed hunk header in " << DiffFile << ": " << Line << "\n";
+                return false;
+            }
+            // an empty new side starts after its line
+            NewLine = NewLeft ? NewStart : NewStart + 1;
+        }
+    }
+    return true;
+}
+
+// --line-ranges entries: <file>:<first>-<last> or <file>:<line>
+static bool load_line_ranges() {
+    for (const std::string &Entry : LineRanges) {
+        StringRef File, Range, First, Last;
+        std::tie(File, Range) = StringRef(Entry).rsplit(':');
+        std::tie(First, Last) = Range.split('-');
+        unsigned FirstLine, LastLine;
+        if (Last.empty())
+            Last = First;
+        if (File.empty() || First.getAsInteger(10, FirstLine) || Last.getAsInteger(10, LastLine) ||
+            FirstLine > LastLine) {
+            llvm::errs() << "Invalid --line-ranges entry '" << Entry << "'\n";
+            return false;
+        }
+        std::string Source = diff_source(File);
+        ChangedLines[Source].push_back({FirstLine, LastLine});
+        DiffKey += Source + ":" + Range.str() + ",";
+    }
+    return true;
+}
+
+static bool load_changed_lines() {
+    if (!DiffFile.empty() && !load_diff())
+        return false;
+    if (!load_line_ranges())
+        return false;
+    for (auto &Entry : ChangedLines) {
+        std::vector<LineRange> &Ranges = Entry.second;
+        std::sort(Ranges.begin(), Ranges.end());
+        std::vector<LineRange> Merged;
+        for (const LineRange &Range : Ranges) {
+            if (!Merged.empty() && Range.first <= Merged.back().second + 1)
+                Merged.back().second = std::max(Merged.back().second, Range.second);
+            else
+                Merged.push_back(Range);
+        }
+        Ranges = std::move(Merged);
+    }
+    return true;
+}
+
+// whether the expansion of Range overlaps a changed line; ranges across files are kept
+static bool changed(const SourceManager &SM, SourceRange Range) {
+    SourceLocation Begin = SM.getExpansionLoc(Range.getBegin());
+    SourceLocation End = SM.getExpansionLoc(Range.getEnd());
+    if (Begin.isInvalid() || End.isInvalid())
+        return false;
+    FileID FID = SM.getFileID(Begin);
+    if (FID != SM.getFileID(End))
+        return true;
+
+    auto Cached = tu_changed.find(FID);
+    if (Cached == tu_changed.end()) {
+        const std::vector<LineRange> *Lines = nullptr;
+        if (const FileEntry *FE = SM.getFileEntryForID(FID)) {
+            SmallString<256> Path(FE->getName());
+            SM.getFileManager().makeAbsolutePath(Path);
+            auto Found = ChangedLines.find(normalize_path(Path));
+            if (Found != ChangedLines.end())
+                Lines = &Found->second;
+        }
+        Cached = tu_changed.insert({FID, Lines}).first;
+    }
+    if (!Cached->second)
+        return false;
+
+    unsigned First = SM.getExpansionLineNumber(Begin);
+    unsigned Last = SM.getExpansionLineNumber(End);
+    // the first range that does not end before First
+    auto It = std::lower_bound(Cached->second->begin(), Cached->second->end(), First,
+                               [](const LineRange &R, unsigned Line) { return R.second < Line; });
+    return It != Cached->second->end() && It->first <= Last;
+}
+
+// whether the condition a rule matched overlaps a changed line
+static bool changed_condition(const MatchFinder::MatchResult &R) {
+    const Expr *Cond = matched_condition(R);
+    return !Cond || changed(*R.SourceManager, Cond->getSourceRange());
+}
+
+/**************** Statistics ****************/
+
+using Clock = std::chrono::steady_clock;
+
+// wall and CPU seconds spent in one phase
+struct PhaseTime {
+    double wall = 0, cpu = 0;
+
+    PhaseTime &operator+=(const PhaseTime &O) {
+        wall += O.wall;
+        cpu += O.cpu;
+        return *this;
+    }
+    PhaseTime &operator-=(const PhaseTime &O) {
+        wall -= O.wall;
+        cpu -= O.cpu;
+        return *this;
+    }
+};
+
+// a point in time, on the wall clock and on the calling thread's CPU clock
+struct Stamp {
+    Clock::time_point wall;
+    double cpu;
+
+    static Stamp now() {
+        timespec TS;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &TS);
+        return {Clock::now(), TS.tv_sec + TS.tv_nsec / 1e9};
+    }
+
+    PhaseTime since() const {
+        Stamp Now = now();
+        PhaseTime T;
+        T.wall = std::chrono::duration<double>(Now.wall - wall).count();
+        T.cpu = Now.cpu - cpu;
+        return T;
+    }
+};
+
+// Phases are disjoint: `match` excludes the edit generation it triggers, and `edits` excludes
+// the consumer. Only `load`, `apply` and `write` run on the main thread.
+struct PhaseTimes {
+    PhaseTime load, parse, match, edits, consumer, apply, write;
+
+    PhaseTimes &operator+=(const PhaseTimes &O) {
+        load += O.load;
+        parse += O.parse;
+        match += O.match;
+        edits += O.edits;
+        consumer += O.consumer;
+        apply += O.apply;
+        write += O.write;
+        return *this;
+    }
+};
+
+// main-thread phases
+static PhaseTimes Times;
+
+// per-TU phases and matches per rule, moved into the TU's FileResult at its end
+static thread_local PhaseTimes tu_times;
+static thread_local Stamp tu_parse_start;
+static thread_local std::map<std::string, int> tu_rule_counts;
+
+// adds the time until stop() or destruction to Slot
+class PhaseTimer {
+public:
+    explicit PhaseTimer(PhaseTime &Slot) : Slot(&Slot), Start(Stamp::now()) {}
+    ~PhaseTimer() { stop(); }
+
+    void stop() {
+        if (Slot)
+            *Slot += Start.since();
+        Slot = nullptr;
+    }
+
+private:
+    PhaseTime *Slot;
+    Stamp Start;
+};
+
+/**
+ * A Transformer that counts the matches of each rule case and times edit generation and the
+ * consumer; matching itself is timed by the ASTConsumer that drives the MatchFinder.
+ * CaseNames name the cases of Rule, in order.
+ */
+class TimedTransformer : public MatchFinder::MatchCallback {
+public:
+    TimedTransformer(const RewriteRule &Rule, std::vector<std::string> CaseNames)
+        : Rule(Rule), CaseNames(std::move(CaseNames)), T(Rule, [](Expected<AtomicChange> C) {
+              llvm::TimeTraceScope Scope("Consumer");
+              PhaseTimer Timer(tu_times.consumer);
+              consumer(std::move(C));
+          }) {}
+
+    void registerMatchers(MatchFinder *Finder) {
+        for (auto &Matcher : transformer::detail::buildMatchers(Rule))
+            Finder->addDynamicMatcher(Matcher, this);
+    }
+
+    void run(const MatchFinder::MatchResult &Result) override {
+        if (!LineCounts.empty() && hot_condition(Result)) {
+            hot_conditions++;
+            return;
+        }
+        if (diff_active() && !changed_condition(Result))
+            return;
+        const std::string &Name = CaseNames[transformer::detail::findSelectedCase(Result, Rule)];
+        llvm::TimeTraceScope Scope("Rule", Name);
+        tu_rule_counts[Name]++;
+        PhaseTime ConsumerBefore = tu_times.consumer;
+        {
+            PhaseTimer Timer(tu_times.edits);
+            T.run(Result);
+        }
+        PhaseTime InConsumer = tu_times.consumer;
+        InConsumer -= ConsumerBefore;
+        tu_times.edits -= InConsumer;
+    }
+
+private:
+    RewriteRule Rule;
+    std::vector<std::string> CaseNames;
+    clang::tooling::Transformer T;
+};
+
+
+/**************** Visitor engine ****************/
+
+// The if-rules without their hasParent() checks; the visitor decides which one applies.
+// Each reuses the edits of its full rule, so both engines produce the same text.
+static const auto if_local_matcher = traverse(TK_IgnoreUnlessSpelledInSource,
+    ifStmt(
+        hasCondition(
+            allOf(
+                expr().bind(if_cond),
+                unless(declRefExpr())
+            )
+        )
+    ).bind(if_stmt)
+);
+
+static RewriteRule else_if_local_rule = makeRule(if_local_matcher, else_if_rule.Cases[0].Edits);
+static RewriteRule case_if_local_rule = makeRule(if_local_matcher, case_if_rule.Cases[0].Edits);
+static RewriteRule if_local_rule = makeRule(if_local_matcher, if_rule.Cases[0].Edits);
+
+// one rule, matched against a single node at a time
+class NodeRule {
+public:
+    NodeRule(const RewriteRule &Rule, std::string Name) : T(Rule, {std::move(Name)}) {
+        T.registerMatchers(&Finder);
+    }
+
+    void run(const Stmt *S, ASTContext &Ctx) { Finder.match(*S, Ctx); }
+
+private:
+    MatchFinder Finder;
+    TimedTransformer T;
+};
+
+// Visits statements parents-first, so an `if` knows whether it hangs off another `if` or a
+// `case` by the time it is reached. This replaces hasParent(), whose first use builds a
+// parent map of the whole TU.
+class CondVisitor : public RecursiveASTVisitor<CondVisitor> {
+public:
+    explicit CondVisitor(ASTContext &Ctx)
+        : Ctx(Ctx), ElseIf(for_modes(else_if_local_rule, if_stmt, if_cond, false), "else_if_rule"),
+          CaseIf(for_modes(case_if_local_rule, if_stmt, if_cond, false), "case_if_rule"),
+          If(for_modes(if_local_rule, if_stmt, if_cond, false), "if_rule"),
+          While(for_modes(while_rule, while_stmt, while_cond, true), "while_rule"),
+          WhileSingle(for_modes(while_rule_single, while_stmt, while_cond, true, while_body_single),
+                      "while_rule_single"),
+          For(for_modes(for_rule, for_stmt, for_cond, true), "for_rule"),
+          ForSingle(for_modes(for_rule_single, for_stmt, for_cond, true, for_body_single),
+                    "for_rule_single") {}
+
+    bool TraverseDecl(Decl *D) {
+        const FunctionDecl *Saved = current_function;
+        if (const auto *FD = dyn_cast_or_null<FunctionDecl>(D))
+            current_function = FD;
+        bool Ret = RecursiveASTVisitor::TraverseDecl(D);
+        current_function = Saved;
+        return Ret;
+    }
+
+    bool VisitCaseStmt(CaseStmt *S) {
+        if (const auto *Sub = dyn_cast_or_null<IfStmt>(S->getSubStmt()))
+            CaseParent.insert(Sub);
+        return true;
+    }
+
+    bool VisitIfStmt(IfStmt *S) {
+        for (const Stmt *Child : {S->getThen(), S->getElse()})
+            if (const auto *Sub = dyn_cast_or_null<IfStmt>(Child))
+                IfParent.insert(Sub);
+
+        if (IfParent.count(S))
+            ElseIf.run(S, Ctx);
+        else if (CaseParent.count(S))
+            CaseIf.run(S, Ctx);
+        else
+            If.run(S, Ctx);
+        return true;
+    }
+
+    bool VisitWhileStmt(WhileStmt *S) {
+        if (isa<CompoundStmt>(S->getBody()))
+            While.run(S, Ctx);
+        else
+            WhileSingle.run(S, Ctx);
+        return true;
+    }
+
+    bool VisitForStmt(ForStmt *S) {
+        if (isa<CompoundStmt>(S->getBody()))
+            For.run(S, Ctx);
+        else
+            ForSingle.run(S, Ctx);
+        return true;
+    }
+
+private:
+    ASTContext &Ctx;
+    NodeRule ElseIf, CaseIf, If, While, WhileSingle, For, ForSingle;
+    llvm::SmallPtrSet<const IfStmt *, 16> IfParent;
+    llvm::SmallPtrSet<const IfStmt *, 16> CaseParent;
+};
+
+class CondVisitorConsumer : public ASTConsumer {
+public:
+    void HandleTranslationUnit(ASTContext &Context) override {
+        CondVisitor V(Context);
+        for (Decl *D : Context.getTraversalScope())
+            V.TraverseDecl(D);
+        current_function = nullptr;
+    }
+};
+
+
+/**************** Per-TU driver ****************/
+
+// changes collected for one source file, over all of its compile commands
+struct FileResult {
+    // bucketed by the absolute path of the file each change edits
+    std::map<std::string, AtomicChanges> ChangesByFile;
+    int changes_count = 0;
+    // for --stats; replayed from the cache, the result has changes only
+    bool cached = false;
+    int failed_changes = 0;
+    int hot_conditions = 0;
+    PhaseTimes times;
+    std::map<std::string, int> rule_counts;
+};
+
+// Results are keyed by source path, so iterating the map gives a deterministic merge order
+// no matter which worker finished first.
+static std::mutex ResultsMutex;
+static std::map<std::string, FileResult> Results;
+
+// the source file the current worker thread is processing
+static thread_local std::string current_source;
+
+// Writes through a temporary file and a rename, so readers never see a partial file.
+static bool write_atomically(const std::string &Path, StringRef Data) {
+    int FD;
+    SmallString<256> TmpPath;
+    if (llvm::sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", FD, TmpPath))
+        return false;
+    {
+        raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << Data;
+        OS.close();
+        if (OS.has_error()) {
+            OS.clear_error();
+            llvm::sys::fs::remove(TmpPath);
+            return false;
+        }
+    }
+    if (llvm::sys::fs::rename(TmpPath, Path)) {
+        llvm::sys::fs::remove(TmpPath);
+        return false;
+    }
+    return true;
+}
+
+
+/**************** Rewrite cache ****************/
+
+// Works like ccache's direct mode: an entry is found by hashing the rule configuration and the
+// compile commands of a source file, and holds the content hash of every file the TU read
+// (main file and all includes) plus the changes it produced. The entry is replayed only if
+// all of those files still hash the same.
+
+static const char *cache_magic = "rewritecond-cache 1";
+
+// Bump whenever the rules or stencils change the edits they produce, so stale entries are
+// not replayed.
+static const char *rules_version = "6";
+
+// --header-filter entries as compile_header_filter() resolved them, so that the same relative
+// entries given in different directories do not share cache entries
+static std::vector<std::string> ResolvedHeaderFilter;
+
+// --pch as the absolute path of the prefix header and a hash of its contents, set in main; TUs
+// parsed with different pre-included code must not share cache entries
+static std::string PCHKey;
+
+// everything besides the inputs that affects the produced changes
+static std::string rule_config() {
+    return std::string("rules=") + rules_version +
+           ";naming=" + std::to_string(static_cast<int>(Naming.getValue())) +
+           ";capture=" + std::to_string(static_cast<int>(Capture.getValue())) +
+           ";loops=" + std::to_string(static_cast<int>(LoopMode.getValue())) +
+           ";engine=" + std::to_string(static_cast<int>(Engine.getValue())) +
+           ";pch=" + PCHKey +
+           ";headers=" + llvm::join(ResolvedHeaderFilter, ",") +
+           ";functions=" + llvm::join(FunctionsInclude.begin(), FunctionsInclude.end(), ",") +
+           ";exclude=" + llvm::join(FunctionsExclude.begin(), FunctionsExclude.end(), ",") +
+           ";profile=" + ProfileKey + ";hot=" + std::to_string(HotThreshold.getValue()) +
+           ";diff=" + DiffKey;
+}
+
+static std::atomic<int> cache_hits{0};
+static std::atomic<int> cache_misses{0};
+
+// files read by the TU(s) of the current worker, with their content hashes
+static thread_local std::map<std::string, uint64_t> current_deps;
+
+static std::string cache_key(const CompilationDatabase &Compilations, const std::string &Path) {
+    std::string AbsPath = getAbsolutePath(Path);
+    SHA1 Hash;
+    Hash.update(cache_magic);
+    Hash.update(rule_config());
+    Hash.update(AbsPath);
+    // the include search path the driver takes from the environment, e.g. from the
+    // rewritecond wrapper; the deps only tell whether the files found before have changed
+    for (const char *Var : {"CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH",
+                            "OBJCPLUS_INCLUDE_PATH"}) {
+        const char *Value = getenv(Var);
+        Hash.update(StringRef("\0", 1));
+        Hash.update(std::string(Var) + "=" + (Value ? Value : ""));
+    }
+    for (const CompileCommand &Cmd : Compilations.getCompileCommands(AbsPath)) {
+        Hash.update(StringRef("\0", 1));
+        Hash.update(Cmd.Directory);
+        for (const auto &Arg : Cmd.CommandLine) {
+            Hash.update(StringRef("\0", 1));
+            Hash.update(Arg);
+        }
+    }
+    return toHex(Hash.final(), /*LowerCase=*/true);
+}
+
+static std::string cache_entry_path(const std::string &Key) {
+    SmallString<256> Path(CacheDir);
+    llvm::sys::path::append(Path, Key.substr(0, 2), Key);
+    return std::string(Path.str());
+}
+
+/**
+ * Entry format (text, one record per line):
+ *   rewritecond-cache 1
+ *   count <changes_count>
+ *   dep <xxhash64 hex> <absolute path>
+ *   change <yaml size> <absolute path of edited file>
+ *   <yaml of the AtomicChange, exactly `yaml size` bytes>
+ */
+static bool cache_lookup(const std::string &Key) {
+    auto Entry = MemoryBuffer::getFile(cache_entry_path(Key));
+    if (!Entry)
+        return false;
+
+    FileResult R;
+    R.cached = true;
+    StringRef Line, Rest = (*Entry)->getBuffer();
+    std::tie(Line, Rest) = Rest.split('\n');
+    if (Line != cache_magic)
+        return false;
+    while (!Rest.empty()) {
+        std::tie(Line, Rest) = Rest.split('\n');
+        StringRef Kind, Args;
+        std::tie(Kind, Args) = Line.split(' ');
+        if (Kind == "count") {
+            if (Args.getAsInteger(10, R.changes_count))
+                return false;
+        } else if (Kind == "dep") {
+            StringRef HashHex, DepPath;
+            std::tie(HashHex, DepPath) = Args.split(' ');
+            uint64_t Hash;
+            if (HashHex.getAsInteger(16, Hash))
+                return false;
+            auto Dep = MemoryBuffer::getFile(DepPath, /*IsText=*/false,
+                                             /*RequiresNullTerminator=*/false);
+            if (!Dep || xxHash64((*Dep)->getBuffer()) != Hash)
+                return false;
+        } else if (Kind == "change") {
+            StringRef Size, Target;
+            std::tie(Size, Target) = Args.split(' ');
+            size_t N;
+            if (Size.getAsInteger(10, N) || N > Rest.size())
+                return false;
+            R.ChangesByFile[Target.str()].push_back(AtomicChange::convertFromYAML(Rest.take_front(N)));
+            Rest = Rest.drop_front(N);
+        } else {
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> Lock(ResultsMutex);
+    Results[current_source] = std::move(R);
+    return true;
+}
+
+static void cache_store(const std::string &Key) {
+    FileResult R;
+    {
+        std::lock_guard<std::mutex> Lock(ResultsMutex);
+        R = Results[current_source];
+    }
+
+    std::string Entry = std::string(cache_magic) + "\n";
+    Entry += "count " + std::to_string(R.changes_count) + "\n";
+    for (const auto &Dep : current_deps)
+        Entry += "dep " + utohexstr(Dep.second) + " " + Dep.first + "\n";
+    for (auto &FileChanges : R.ChangesByFile) {
+        for (auto &C : FileChanges.second) {
+            std::string YAML = C.toYAMLString();
+            Entry += "change " + std::to_string(YAML.size()) + " " + FileChanges.first + "\n";
+            Entry += YAML;
+        }
+    }
+
+    std::string Path = cache_entry_path(Key);
+    if (llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path)) ||
+        !write_atomically(Path, Entry))
+        llvm::errs() << "Cannot write cache entry " << Path << "\n";
+}
+
+/**************** Rewrite cache END ****************/
+
+/**************** Match scope ****************/
+
+// --header-filter, compiled once in main()
+static std::vector<std::string> HeaderPrefixes;
+static std::vector<GlobPattern> HeaderGlobs;
+
+static bool compile_header_filter() {
+    for (const std::string &Entry : HeaderFilter) {
+        if (Entry.empty())
+            continue;
+        std::string Pattern = Entry;
+        if (!llvm::sys::path::is_absolute(Pattern) && Pattern[0] != '*')
+            Pattern = getAbsolutePath(Pattern);
+        if (Entry.find_first_of("*?[") == std::string::npos) {
+            HeaderPrefixes.push_back(normalize_path(SmallString<256>(Pattern)));
+            ResolvedHeaderFilter.push_back(HeaderPrefixes.back());
+            continue;
+        }
+        ResolvedHeaderFilter.push_back(Pattern);
+        auto Glob = GlobPattern::create(Pattern);
+        if (!Glob) {
+            llvm::errs() << "Invalid --header-filter entry '" << Entry << "': "
+                         << toString(Glob.takeError()) << "\n";
+            return false;
+        }
+        HeaderGlobs.push_back(std::move(*Glob));
+    }
+    return true;
+}
+
+// whether a header (absolute, normalized path) may be rewritten; main files always are
+static bool header_allowed(StringRef Path) {
+    if (!PCHHeader.empty())
+        return false;
+    for (const auto &Prefix : HeaderPrefixes) {
+        // a prefix of the path, not of a name: src/ allows src/x.h but not src2/x.h
+        if (Path.startswith(Prefix) &&
+            (Path.size() == Prefix.size() || llvm::sys::path::is_separator(Prefix.back()) ||
+             llvm::sys::path::is_separator(Path[Prefix.size()])))
+            return true;
+    }
+    for (const auto &Glob : HeaderGlobs)
+        if (Glob.match(Path))
+            return true;
+    return false;
+}
+
+// --functions-include/--functions-exclude, compiled once in main()
+struct NamePatterns {
+    std::vector<GlobPattern> Globs;
+    std::vector<llvm::Regex> Regexes;
+
+    bool empty() const { return Globs.empty() && Regexes.empty(); }
+
+    bool match(StringRef Name) const {
+        for (const auto &Glob : Globs)
+            if (Glob.match(Name))
+                return true;
+        for (const auto &Re : Regexes)
+            if (Re.match(Name))
+                return true;
+        return false;
+    }
+};
+
+static NamePatterns IncludedFunctions;
+static NamePatterns ExcludedFunctions;
+
+static bool compile_name_patterns(const cl::list<std::string> &Entries, StringRef Option,
+                                  NamePatterns &Patterns) {
+    for (const std::string &Entry : Entries) {
+        if (Entry.empty())
+            continue;
+        StringRef Pattern(Entry);
+        std::string Error;
+        if (Pattern.consume_front("re:")) {
+            // anchored, so that a regex selects whole names as a glob does
+            llvm::Regex Re(("^(" + Pattern + ")$").str());
+            if (Re.isValid(Error)) {
+                Patterns.Regexes.push_back(std::move(Re));
+                continue;
+            }
+        } else {
+            auto Glob = GlobPattern::create(Pattern);
+            if (Glob) {
+                Patterns.Globs.push_back(std::move(*Glob));
+                continue;
+            }
+            Error = toString(Glob.takeError());
+        }
+        llvm::errs() << "Invalid --" << Option << " entry '" << Entry << "': " << Error << "\n";
+        return false;
+    }
+    return true;
+}
+
+static bool compile_function_filter() {
+    return compile_name_patterns(FunctionsInclude, "functions-include", IncludedFunctions) &&
+           compile_name_patterns(FunctionsExclude, "functions-exclude", ExcludedFunctions);
+}
+
+static bool function_filter_active() {
+    return !IncludedFunctions.empty() || !ExcludedFunctions.empty();
+}
+
+static bool function_selected(const FunctionDecl *FD) {
+    std::string Name = FD->getQualifiedNameAsString();
+    if (!IncludedFunctions.empty() && !IncludedFunctions.match(Name))
+        return false;
+    return !ExcludedFunctions.match(Name);
+}
+
+/**
+ * Restricts matching to the top-level declarations of the main file and of allowed headers,
+ * by setting the AST traversal scope before the MatchFinder runs. Everything else, in
+ * particular libc and system headers, is never walked, and the parent map is only built
+ * for the declarations in scope. With --functions-include/--functions-exclude, the scope is
+ * narrowed further to the selected function definitions, so the bodies of all other
+ * functions are never matched against the rules. With --diff or --line-ranges, declarations
+ * that overlap no changed line are left out as well.
+ */
+class ScopedMatchConsumer : public ASTConsumer {
+public:
+    explicit ScopedMatchConsumer(std::unique_ptr<ASTConsumer> Inner) : Inner(std::move(Inner)) {}
+
+    void Initialize(ASTContext &Context) override {
+        Ctx = &Context;
+        Inner->Initialize(Context);
+    }
+
+    bool HandleTopLevelDecl(DeclGroupRef DG) override {
+        for (Decl *D : DG) {
+            if (function_filter_active())
+                add_functions(D);
+            else if (in_scope(D->getLocation()) && in_diff(D))
+                Scope.push_back(D);
+        }
+        return Inner->HandleTopLevelDecl(DG);
+    }
+
+    void HandleTranslationUnit(ASTContext &Context) override {
+        tu_times.parse += tu_parse_start.since();
+        // matching is everything the inner consumer does, less the edit generation it triggers
+        PhaseTime Before = tu_times.edits;
+        Before += tu_times.consumer;
+        {
+            llvm::TimeTraceScope TraceScope("Match");
+            PhaseTimer Timer(tu_times.match);
+            Context.setTraversalScope(Scope);
+            Inner->HandleTranslationUnit(Context);
+        }
+        tu_times.match += Before;
+        tu_times.match -= tu_times.edits;
+        tu_times.match -= tu_times.consumer;
+    }
+
+private:
+    // with a function filter, the scope is the selected function definitions themselves,
+    // including methods and functions nested in namespaces, classes and linkage specs
+    void add_functions(Decl *D) {
+        if (auto *FTD = dyn_cast<FunctionTemplateDecl>(D))
+            D = FTD->getTemplatedDecl();
+        else if (auto *CTD = dyn_cast<ClassTemplateDecl>(D))
+            D = CTD->getTemplatedDecl();
+
+        if (auto *FD = dyn_cast<FunctionDecl>(D)) {
+            if (FD->doesThisDeclarationHaveABody() && in_scope(FD->getLocation()) &&
+                function_selected(FD) && in_diff(FD))
+                Scope.push_back(FD);
+            return;
+        }
+        // a namespace or class body belongs to one file, so whole headers out of scope are
+        // skipped without looking at their members
+        if ((isa<NamespaceDecl>(D) || isa<LinkageSpecDecl>(D) || isa<CXXRecordDecl>(D)) &&
+            in_scope(D->getLocation()))
+            for (Decl *Child : cast<DeclContext>(D)->decls())
+                add_functions(Child);
+    }
+
+    bool in_diff(const Decl *D) {
+        return !diff_active() || changed(Ctx->getSourceManager(), D->getSourceRange());
+    }
+
+    bool in_scope(SourceLocation Loc) {
+        if (Loc.isInvalid())
+            return false;
+        const SourceManager &SM = Ctx->getSourceManager();
+        FileID FID = SM.getFileID(SM.getExpansionLoc(Loc));
+        if (FID == SM.getMainFileID())
+            return true;
+        auto Cached = FileInScope.find(FID);
+        if (Cached != FileInScope.end())
+            return Cached->second;
+
+        bool Allowed = false;
+        if (const FileEntry *FE = SM.getFileEntryForID(FID)) {
+            SmallString<256> Path(FE->getName());
+            SM.getFileManager().makeAbsolutePath(Path);
+            Allowed = header_allowed(normalize_path(Path));
+        }
+        FileInScope[FID] = Allowed;
+        return Allowed;
+    }
+
+    std::unique_ptr<ASTConsumer> Inner;
+    ASTContext *Ctx = nullptr;
+    std::vector<Decl *> Scope;
+    llvm::DenseMap<FileID, bool> FileInScope;
+};
+
+/**************** Match scope END ****************/
+
+// The matchers are built once per thread and shared by all TUs it processes.
+struct MatchSetup {
+    MatchSetup() : T(selected_rules(), rule_names) {
+        T.registerMatchers(&Finder);
+    }
+
+    MatchFinder Finder;
+    TimedTransformer T;
+};
+
+static MatchSetup &match_setup() {
+    static thread_local MatchSetup Setup;
+    return Setup;
+}
+
+/**
+ * Frontend action running the rules over one translation unit. It uses its thread's
+ * MatchSetup, and starts from fresh naming/change state.
+ */
+class RewriteCondAction : public ASTFrontendAction {
+protected:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef InFile) override {
+        new_var_count = 0;
+        stable_key_count.clear();
+        changes_count = 0;
+        Changes.clear();
+        failed_changes = 0;
+        hot_conditions = 0;
+        tu_profiles.clear();
+        tu_changed.clear();
+        tu_times = PhaseTimes();
+        tu_rule_counts.clear();
+        tu_parse_start = Stamp::now();
+        if (Engine == EngineMode::Visitor)
+            return std::make_unique<ScopedMatchConsumer>(std::make_unique<CondVisitorConsumer>());
+        return std::make_unique<ScopedMatchConsumer>(match_setup().Finder.newASTConsumer());
+    }
+
+    void EndSourceFileAction() override {
+        std::lock_guard<std::mutex> Lock(ResultsMutex);
+        FileResult &R = Results[current_source];
+        // paths in AtomicChange are as the SourceManager saw them, possibly relative to the
+        // compile command's directory; resolve them while that directory is still current
+        const FileManager &FM = getCompilerInstance().getFileManager();
+        const SourceManager &SM = getCompilerInstance().getSourceManager();
+        StringRef MainFile = SM.getFileEntryForID(SM.getMainFileID())->getName();
+        for (auto &C : Changes) {
+            SmallString<256> Path(C.getFilePath());
+            FM.makeAbsolutePath(Path);
+            std::string AbsPath = normalize_path(Path);
+            // a rule matched in scope can still edit other files, e.g. through a macro defined
+            // in a header; with a PCH, only the main file is parsed and may be edited
+            if (C.getFilePath() != MainFile && !header_allowed(AbsPath))
+                continue;
+            R.ChangesByFile[AbsPath].push_back(std::move(C));
+            R.changes_count++;
+        }
+        Changes.clear();
+        R.failed_changes += failed_changes;
+        R.hot_conditions += hot_conditions;
+        R.times += tu_times;
+        for (const auto &Count : tu_rule_counts)
+            R.rule_counts[Count.first] += Count.second;
+
+        if (!CacheDir.empty())
+            record_deps(FM);
+    }
+
+private:
+    // hash every file this TU read, as the parser saw it
+    void record_deps(const FileManager &FM) {
+        SourceManager &SM = getCompilerInstance().getSourceManager();
+        std::vector<const FileEntry *> Files;
+        for (auto It = SM.fileinfo_begin(); It != SM.fileinfo_end(); ++It)
+            Files.push_back(It->first);
+        for (const FileEntry *File : Files) {
+            auto Buffer = SM.getMemoryBufferForFileOrNone(File);
+            if (!Buffer)
+                continue;
+            SmallString<256> Path(File->getName());
+            FM.makeAbsolutePath(Path);
+            current_deps[normalize_path(Path)] = xxHash64(Buffer->getBuffer());
+        }
+    }
+};
+
+/**************** Precompiled prefix header ****************/
+
+// where PCHs of this run live; removed when the run ends
+static SmallString<256> PCHDir;
+
+struct PCHEntry {
+    std::once_flag Built;
+    std::string Path; // empty if the build failed
+};
+
+static std::mutex PCHMutex;
+static std::map<std::string, std::unique_ptr<PCHEntry>> PCHs;
+
+// Same output file handling as -emit-pch, without going through the driver's -o.
+class BuildPCHAction : public GeneratePCHAction {
+public:
+    explicit BuildPCHAction(std::string Output) : Output(std::move(Output)) {}
+
+protected:
+    bool BeginInvocation(CompilerInstance &CI) override {
+        CI.getFrontendOpts().OutputFile = Output;
+        return GeneratePCHAction::BeginInvocation(CI);
+    }
+
+private:
+    std::string Output;
+};
+
+// the adjusters ClangTool applies by default, so flag sets are keyed like the final commands
+static CommandLineArguments default_adjusted(const CompileCommand &Cmd) {
+    ArgumentsAdjuster Adjust = combineAdjusters(
+        getClangStripOutputAdjuster(),
+        combineAdjusters(getClangSyntaxOnlyAdjuster(), getClangStripDependencyFileAdjuster()));
+    return Adjust(Cmd.CommandLine, Cmd.Filename);
+}
+
+// the command line without its input file: TUs with the same flag set share a PCH
+static CommandLineArguments flag_set(const CommandLineArguments &Args, StringRef Filename) {
+    CommandLineArguments Flags;
+    for (const auto &Arg : Args)
+        if (Arg != Filename)
+            Flags.push_back(Arg);
+    return Flags;
+}
+
+static bool is_cxx_file(StringRef Filename) {
+    StringRef Ext = llvm::sys::path::extension(Filename);
+    return Ext == ".cc" || Ext == ".cpp" || Ext == ".cxx" || Ext == ".c++" || Ext == ".C" ||
+           Ext == ".hpp" || Ext == ".hh" || Ext == ".hxx";
+}
+
+static std::string build_pch(const std::string &Directory, CommandLineArguments Flags,
+                             bool CXX, const std::string &Output) {
+    Flags.push_back("-x");
+    Flags.push_back(CXX ? "c++-header" : "c-header");
+    Flags.push_back(PCHHeader);
+
+    auto FS = llvm::vfs::createPhysicalFileSystem();
+    FS->setCurrentWorkingDirectory(Directory);
+    IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOptions(), std::move(FS)));
+    ToolInvocation Invocation(std::move(Flags), std::make_unique<BuildPCHAction>(Output),
+                              Files.get());
+    if (!Invocation.run()) {
+        llvm::errs() << "Cannot precompile " << PCHHeader << "; TUs with these flags are parsed "
+                     << "without it\n";
+        return "";
+    }
+    return Output;
+}
+
+// Returns the PCH for the given flag set, building it on first request. Concurrent requests for
+// the same flag set wait for the single build.
+static std::string pch_for(const std::string &Directory, const CommandLineArguments &Flags,
+                           bool CXX) {
+    std::string Key = Directory;
+    for (const auto &Flag : Flags) {
+        Key += '\0';
+        Key += Flag;
+    }
+    PCHEntry *Entry;
+    {
+        std::lock_guard<std::mutex> Lock(PCHMutex);
+        auto &Slot = PCHs[Key];
+        if (!Slot)
+            Slot = std::make_unique<PCHEntry>();
+        Entry = Slot.get();
+    }
+    std::call_once(Entry->Built, [&] {
+        SHA1 Hash;
+        Hash.update(Key);
+        SmallString<256> Output(PCHDir);
+        llvm::sys::path::append(Output, toHex(Hash.final(), /*LowerCase=*/true) + ".pch");
+        Entry->Path = build_pch(Directory, Flags, CXX, std::string(Output.str()));
+    });
+    return Entry->Path;
+}
+
+// Makes every compile command of `Path` load the PCH built for its flag set.
+static void add_pch_adjuster(ClangTool &Tool, const CompilationDatabase &Compilations,
+                             const std::string &Path) {
+    std::map<CommandLineArguments, std::string> PCHByFlags;
+    for (const CompileCommand &Cmd : Compilations.getCompileCommands(getAbsolutePath(Path))) {
+        CommandLineArguments Flags = flag_set(default_adjusted(Cmd), Cmd.Filename);
+        PCHByFlags[Flags] = pch_for(Cmd.Directory, Flags, is_cxx_file(Cmd.Filename));
+    }
+    Tool.appendArgumentsAdjuster(
+        [PCHByFlags](const CommandLineArguments &Args, StringRef Filename) {
+            auto It = PCHByFlags.find(flag_set(Args, Filename));
+            if (It == PCHByFlags.end() || It->second.empty())
+                return Args;
+            CommandLineArguments Adjusted(Args);
+            Adjusted.insert(Adjusted.begin() + 1, {"-include-pch", It->second});
+            return Adjusted;
+        });
+}
+
+/**************** Precompiled prefix header END ****************/
+
+
+// whether the file on disk already includes the runtime header
+static bool has_hook_include(const std::string &Path) {
+    auto Buffer = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    return Buffer && (*Buffer)->getBuffer().contains(hook_include);
+}
+
+/**
+ * Writes the changes of the current source as a TranslationUnitReplacements document, the
+ * input format of clang-apply-replacements. The file name includes a hash of the full path, so
+ * sources with the same name in different directories do not collide.
+ */
+static bool export_fixes(const std::string &Path) {
+    TranslationUnitReplacements TUR;
+    TUR.MainSourceFile = normalize_path(SmallString<256>(getAbsolutePath(Path)));
+    {
+        std::lock_guard<std::mutex> Lock(ResultsMutex);
+        for (const auto &FileChanges : Results[current_source].ChangesByFile) {
+            for (const auto &C : FileChanges.second)
+                for (const auto &R : C.getReplacements())
+                    TUR.Replacements.emplace_back(FileChanges.first, R.getOffset(), R.getLength(),
+                                                  R.getReplacementText());
+            // identical copies from other TUs are merged by clang-apply-replacements
+            if (Capture == CaptureMode::Hook && !FileChanges.second.empty() &&
+                !has_hook_include(FileChanges.first))
+                TUR.Replacements.emplace_back(FileChanges.first, 0, 0, hook_include);
+        }
+    }
+
+    std::string YAMLText;
+    {
+        raw_string_ostream OS(YAMLText);
+        yaml::Output YAML(OS);
+        YAML << TUR;
+    }
+    SmallString<256> Out(ExportFixesDir.getValue());
+    llvm::sys::path::append(Out, llvm::sys::path::filename(TUR.MainSourceFile) + "-" +
+                                     llvm::utohexstr(xxHash64(TUR.MainSourceFile)) + ".yaml");
+    if (!write_atomically(std::string(Out.str()), YAMLText)) {
+        llvm::errs() << "Cannot write " << Out << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Remembers the result of every stat, in particular the failed lookups of header search along
+ * the include path, which dominate the file system work of a TU. Files are still opened, and
+ * then stat'ed, through the underlying file system, so their contents are never stale.
+ * Only used by the single-threaded --serve loop, which invalidates entries between requests.
+ */
+class StatCacheFS : public llvm::vfs::ProxyFileSystem {
+public:
+    explicit StatCacheFS(IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+        : ProxyFileSystem(std::move(FS)) {}
+
+    llvm::ErrorOr<llvm::vfs::Status> status(const Twine &Path) override {
+        std::string Key = key(Path);
+        auto It = Stats.find(Key);
+        if (It != Stats.end())
+            return It->second;
+        auto Status = ProxyFileSystem::status(Path);
+        Stats.insert({Key, Status});
+        return Status;
+    }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const Twine &Path) override {
+        std::string Key = key(Path);
+        auto It = Stats.find(Key);
+        if (It != Stats.end() && !It->second)
+            return It->second.getError();
+        auto File = ProxyFileSystem::openFileForRead(Path);
+        if (!File && File.getError() == std::errc::no_such_file_or_directory)
+            Stats.insert({Key, File.getError()});
+        return File;
+    }
+
+    void invalidate(const Twine &Path) { Stats.erase(key(Path)); }
+    void clear() { Stats.clear(); }
+
+private:
+    std::string key(const Twine &Path) {
+        SmallString<256> Abs;
+        Path.toVector(Abs);
+        makeAbsolute(Abs);
+        return normalize_path(Abs);
+    }
+
+    llvm::StringMap<llvm::ErrorOr<llvm::vfs::Status>> Stats;
+};
+
+// set by --serve; otherwise every source gets a fresh physical file system
+static IntrusiveRefCntPtr<StatCacheFS> ServeFS;
+
+/**
+ * Runs the rules over every compile command of one source file.
+ * Like AllTUsToolExecutor, each call gets its own ClangTool and physical file system, so
+ * workers do not race on the process working directory.
+ */
+static int run_on_source(const CompilationDatabase &Compilations, const std::string &Path) {
+    llvm::TimeTraceScope Scope("Source", Path);
+    current_source = Path;
+
+    std::string Key;
+    if (!CacheDir.empty()) {
+        Key = cache_key(Compilations, Path);
+        if (cache_lookup(Key)) {
+            cache_hits++;
+            if (!ExportFixesDir.empty() && !export_fixes(Path))
+                return 1;
+            return 0;
+        }
+        cache_misses++;
+        current_deps.clear();
+    }
+
+    IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS = ServeFS;
+    if (!FS)
+        FS = llvm::vfs::createPhysicalFileSystem();
+    ClangTool Tool(Compilations, {Path}, std::make_shared<PCHContainerOperations>(), FS);
+    if (!PCHHeader.empty())
+        add_pch_adjuster(Tool, Compilations, Path);
+    int Ret = Tool.run(newFrontendActionFactory<RewriteCondAction>().get());
+
+    // only cache complete, error-free results
+    if (!CacheDir.empty() && Ret == 0)
+        cache_store(Key);
+    if (!ExportFixesDir.empty() && !export_fixes(Path))
+        return 1;
+    return Ret;
+}
+
+/**************** Per-TU driver END ****************/
+
+
+/**************** Formatting ****************/
+
+static bool is_identifier_char(char c) {
+    return isAlphanumeric(c) || c == '_';
+}
+
+/**
+ * If a comment, a string or character literal, or a number starts at Code[i], returns the
+ * offset of its last character; otherwise returns i. Numbers are skipped whole, so that a
+ * C++14 digit separator (1'000) is not taken for the start of a character literal. An
+ * unterminated comment or literal extends to the end of Code.
+ */
+static size_t skip_lexeme(StringRef Code, size_t i) {
+    size_t n = Code.size();
+    char c = Code[i];
+    if (c == '/' && i + 1 < n && Code[i + 1] == '/') {
+        while (i + 1 < n && Code[i + 1] != '\n')
+            i++;
+    } else if (c == '/' && i + 1 < n && Code[i + 1] == '*') {
+        size_t End = Code.find("*/", i + 2);
+        i = End == StringRef::npos ? n - 1 : End + 1;
+    } else if (c == '"' || c == '\'') {
+        for (i++; i < n && Code[i] != c; i++)
+            if (Code[i] == '\\')
+                i++;
+        i = std::min(i, n - 1);
+    } else if (isDigit(c) && (i == 0 || !is_identifier_char(Code[i - 1]))) {
+        // a pp-number: digits, letters, dots, separators and signed exponents
+        while (i + 1 < n) {
+            char Next = Code[i + 1];
+            if (is_identifier_char(Next) || Next == '.')
+                i++;
+            else if (Next == '\'' && i + 2 < n && is_identifier_char(Code[i + 2]))
+                i++;
+            else if ((Next == '+' || Next == '-') && strchr("eEpP", Code[i]))
+                i++;
+            else
+                break;
+        }
+    }
+    return i;
+}
+
+/**
+ * Offsets at which a top-level declaration may start: the beginning of the file, and the start
+ * of the line following every top-level `}` or `;` and every preprocessor directive outside of
+ * braces. Namespace bodies do not count as braces, so the declarations inside a namespace are
+ * split like those at file scope. This is a lexical scan (comments and literals are skipped),
+ * much cheaper than letting clang-format annotate the whole file.
+ * Returns an empty list when braces do not balance, e.g. across #if branches.
+ */
+static std::vector<unsigned> top_level_boundaries(StringRef Code) {
+    std::vector<unsigned> Bounds = {0};
+    int Depth = 0;                  // open braces, not counting namespace bodies
+    std::vector<bool> Namespaces;   // for every open brace, whether it opened a namespace body
+    bool NamespaceHead = false;     // `namespace` seen at depth 0, its `{` not yet
+    bool LineStart = true;          // only whitespace seen on this line so far
+    bool BoundaryAtEOL = false;     // a top-level declaration ends on this line
+    for (size_t i = 0, n = Code.size(); i < n; i++) {
+        char c = Code[i];
+        if (c == '\n') {
+            if (BoundaryAtEOL && Depth == 0)
+                Bounds.push_back(i + 1);
+            LineStart = true;
+            BoundaryAtEOL = false;
+            continue;
+        }
+        if (isWhitespace(c))
+            continue;
+        if (LineStart && c == '#') {
+            // preprocessor directive: skip to the end of the (continued) line
+            while (i + 1 < n && !(Code[i + 1] == '\n' && Code[i] != '\\'))
+                i++;
+            BoundaryAtEOL = true;
+            continue;
+        }
+        LineStart = false;
+        size_t End = skip_lexeme(Code, i);
+        if (End != i) {
+            i = End;
+        } else if (is_identifier_char(c)) {
+            size_t Begin = i;
+            while (i + 1 < n && is_identifier_char(Code[i + 1]))
+                i++;
+            if (Depth == 0 && Code.slice(Begin, i + 1) == "namespace")
+                NamespaceHead = true;
+        } else if (c == '{') {
+            Namespaces.push_back(NamespaceHead);
+            if (NamespaceHead)
+                BoundaryAtEOL = true;
+            else
+                Depth++;
+            NamespaceHead = false;
+        } else if (c == '}') {
+            if (Namespaces.empty())
+                return {};
+            bool Namespace = Namespaces.back();
+            Namespaces.pop_back();
+            if (!Namespace)
+                Depth--;
+            if (Depth == 0)
+                BoundaryAtEOL = true;
+        } else if ((c == ';' || c == '=') && Depth == 0) {
+            // `using namespace x;` and namespace aliases have no body
+            NamespaceHead = false;
+            if (c == ';')
+                BoundaryAtEOL = true;
+        }
+    }
+    if (!Namespaces.empty())
+        return {};
+    return Bounds;
+}
+
+/**
+ * Formats the `Affected` ranges of `Code`, giving clang-format only the enclosing top-level
+ * declarations as input instead of the whole file.
+ */
+static std::string format_edited_ranges(StringRef Path, StringRef Code,
+                                        const std::vector<Range> &Affected,
+                                        const format::FormatStyle &Style) {
+    std::vector<unsigned> Bounds = top_level_boundaries(Code);
+    if (Bounds.empty())
+        Bounds = {0}; // unbalanced: a single region covering the whole file
+
+    // expand each range to the region between its surrounding boundaries, merging overlaps
+    struct Region {
+        unsigned Begin, End;
+        std::vector<Range> Ranges;
+    };
+    std::vector<Region> Regions;
+    for (const Range &R : Affected) {
+        unsigned Last = R.getLength() ? R.getOffset() + R.getLength() - 1 : R.getOffset();
+        auto BeginIt = std::upper_bound(Bounds.begin(), Bounds.end(), R.getOffset()) - 1;
+        auto EndIt = std::upper_bound(Bounds.begin(), Bounds.end(), Last);
+        Regions.push_back({*BeginIt, EndIt == Bounds.end() ? unsigned(Code.size()) : *EndIt, {R}});
+    }
+    std::sort(Regions.begin(), Regions.end(),
+              [](const Region &A, const Region &B) { return A.Begin < B.Begin; });
+    std::vector<Region> Merged;
+    for (auto &R : Regions) {
+        if (!Merged.empty() && R.Begin < Merged.back().End) {
+            Merged.back().End = std::max(Merged.back().End, R.End);
+            Merged.back().Ranges.push_back(R.Ranges[0]);
+        } else {
+            Merged.push_back(std::move(R));
+        }
+    }
+
+    std::string Out;
+    Out.reserve(Code.size());
+    unsigned Prev = 0;
+    for (const Region &R : Merged) {
+        Out += Code.slice(Prev, R.Begin).str();
+        StringRef Text = Code.slice(R.Begin, R.End);
+        std::vector<Range> Local;
+        for (const Range &A : R.Ranges)
+            Local.push_back(Range(A.getOffset() - R.Begin, A.getLength()));
+        auto Formatted = applyAllReplacements(Text, format::reformat(Style, Text, Local, Path));
+        if (Formatted) {
+            Out += *Formatted;
+        } else {
+            consumeError(Formatted.takeError());
+            Out += Text.str();
+        }
+        Prev = R.End;
+    }
+    Out += Code.substr(Prev).str();
+    return Out;
+}
+
+/**
+ * --format=none: gives every closing brace at the start of a line within the Affected ranges
+ * the indentation of the line its opening brace is on. One lexical pass; if braces do not
+ * balance, Code is returned as is.
+ */
+static std::string indent_closers(StringRef Code, std::vector<Range> Affected) {
+    std::sort(Affected.begin(), Affected.end(), [](const Range &A, const Range &B) {
+        return A.getOffset() < B.getOffset();
+    });
+    std::vector<size_t> Opens; // for every open brace, the start of its line
+    std::string Out;
+    Out.reserve(Code.size() + Affected.size() * 8);
+    size_t Copied = 0, LineBegin = 0, Next = 0;
+    bool LineStart = true;
+    for (size_t i = 0, n = Code.size(); i < n; i++) {
+        char c = Code[i];
+        if (c == '\n') {
+            LineBegin = i + 1;
+            LineStart = true;
+            continue;
+        }
+        if (isWhitespace(c))
+            continue;
+        if (LineStart && c == '#') {
+            while (i + 1 < n && !(Code[i + 1] == '\n' && Code[i] != '\\'))
+                i++;
+            continue;
+        }
+        LineStart = false;
+        size_t End = skip_lexeme(Code, i);
+        if (End != i) {
+            i = End;
+        } else if (c == '{') {
+            Opens.push_back(LineBegin);
+        } else if (c == '}') {
+            if (Opens.empty())
+                return Code.str();
+            size_t Open = Opens.back();
+            Opens.pop_back();
+            while (Next < Affected.size() &&
+                   Affected[Next].getOffset() + Affected[Next].getLength() <= i)
+                Next++;
+            if (i != LineBegin || Next == Affected.size() || Affected[Next].getOffset() > i)
+                continue;
+            size_t Indent = Open;
+            while (Indent < n && (Code[Indent] == ' ' || Code[Indent] == '\t'))
+                Indent++;
+            Out.append(Code.data() + Copied, i - Copied);
+            Out.append(Code.data() + Open, Indent - Open);
+            Copied = i;
+        }
+    }
+    if (!Opens.empty())
+        return Code.str();
+    Out.append(Code.data() + Copied, Code.size() - Copied);
+    return Out;
+}
+
+// created on first use, so that --format=none never calls into clang-format
+static const format::FormatStyle &format_style() {
+    static const format::FormatStyle Style =
+        format::getGoogleStyle(format::FormatStyle::LanguageKind::LK_Cpp);
+    return Style;
+}
+
+// same combination as applyAtomicChanges, minus header insertion and cleanup
+static Error combine_changes(StringRef Path, ArrayRef<AtomicChange> Changes,
+                             Replacements &Replaces) {
+    for (const auto &C : Changes)
+        for (const auto &R : C.getReplacements())
+            if (auto Err = Replaces.add(Replacement(Path, R.getOffset(), R.getLength(),
+                                                    R.getReplacementText())))
+                return Err;
+    return Error::success();
+}
+
+// changes dropped by the linear engine because they overlap an earlier change
+static int apply_conflicts = 0;
+
+/**
+ * The linear apply engine. All replacements are sorted once by offset; at equal offsets,
+ * insertions come before a replaced range, and otherwise keep the order in which the changes
+ * were produced. (Replacements instead rejects different insertions at one offset.) One sweep
+ * over the sorted pieces drops every change with a piece that starts inside a range replaced
+ * by another change, and a second one builds the output from the pieces of the remaining
+ * changes. Affected receives the ranges of inserted text in the output.
+ */
+static std::string apply_linear(StringRef Path, StringRef Code, ArrayRef<AtomicChange> Changes,
+                                std::vector<Range> &Affected) {
+    struct Piece {
+        unsigned Offset, Length;
+        StringRef Text;
+        unsigned Change;
+    };
+    std::vector<Piece> Pieces;
+    for (unsigned I = 0; I < Changes.size(); I++)
+        for (const auto &R : Changes[I].getReplacements())
+            Pieces.push_back({R.getOffset(), R.getLength(), R.getReplacementText(), I});
+    std::stable_sort(Pieces.begin(), Pieces.end(), [](const Piece &A, const Piece &B) {
+        if (A.Offset != B.Offset)
+            return A.Offset < B.Offset;
+        return A.Length == 0 && B.Length != 0;
+    });
+
+    // a piece conflicts if it starts inside the range replaced by a piece kept before it; its
+    // change is dropped. End may still cover pieces kept before their change was dropped, which
+    // can only drop more, never let an overlap through.
+    std::vector<bool> Dropped(Changes.size(), false);
+    unsigned End = 0, Owner = 0;
+    for (const Piece &P : Pieces) {
+        if (Dropped[P.Change])
+            continue;
+        if (P.Offset < End && P.Change != Owner) {
+            Dropped[P.Change] = true;
+            apply_conflicts++;
+            llvm::errs() << Path << ": dropped change " << Changes[P.Change].getKey()
+                         << ", which overlaps another change\n";
+            continue;
+        }
+        if (P.Offset + P.Length > End) {
+            End = P.Offset + P.Length;
+            Owner = P.Change;
+        }
+    }
+
+    size_t Size = Code.size();
+    for (const Piece &P : Pieces)
+        if (!Dropped[P.Change])
+            Size += P.Text.size() - P.Length;
+    std::string Out;
+    Out.reserve(Size);
+    unsigned Pos = 0;
+    for (const Piece &P : Pieces) {
+        if (Dropped[P.Change] || P.Offset < Pos)
+            continue;
+        Out.append(Code.data() + Pos, P.Offset - Pos);
+        Affected.push_back(Range(Out.size(), P.Text.size()));
+        Out.append(P.Text.data(), P.Text.size());
+        Pos = P.Offset + P.Length;
+    }
+    Out.append(Code.data() + Pos, Code.size() - Pos);
+    return Out;
+}
+
+static Expected<std::string> apply_changes(StringRef Path, StringRef Code,
+                                           ArrayRef<AtomicChange> Changes) {
+    llvm::TimeTraceScope Scope("Apply", Path);
+    if (ApplyEngine == ApplyMode::Linear) {
+        std::vector<Range> Affected;
+        std::string ChangedCode = apply_linear(Path, Code, Changes, Affected);
+        if (FormatScope == FormatMode::None)
+            return indent_closers(ChangedCode, Affected);
+        llvm::TimeTraceScope Trace("Format");
+        if (FormatScope == FormatMode::Edits)
+            return format_edited_ranges(Path, ChangedCode, Affected, format_style());
+        return applyAllReplacements(ChangedCode,
+                                    format::reformat(format_style(), ChangedCode, Affected, Path));
+    }
+    if (FormatScope == FormatMode::All) {
+        // applies the changes and formats around them in one go
+        llvm::TimeTraceScope ApplyScope("applyAtomicChanges");
+        ApplyChangesSpec Spec;
+        Spec.Format = ApplyChangesSpec::kAll;
+        Spec.Style = format_style();
+        return applyAtomicChanges(Path, Code, Changes, Spec);
+    }
+
+    Replacements Replaces;
+    if (auto Err = combine_changes(Path, Changes, Replaces))
+        return std::move(Err);
+    auto ChangedCode = applyAllReplacements(Code, Replaces);
+    if (!ChangedCode)
+        return ChangedCode;
+    if (FormatScope == FormatMode::None)
+        return indent_closers(*ChangedCode, Replaces.getAffectedRanges());
+    llvm::TimeTraceScope Trace("Format");
+    return format_edited_ranges(Path, *ChangedCode, Replaces.getAffectedRanges(), format_style());
+}
+
+/**************** Formatting END ****************/
+
+
+/**
+ * A header included by many TUs receives the same edits from each of them. The merge keeps one
+ * change per (file, replaced offsets) site: an identical copy is a duplicate, and a copy with
+ * different text (e.g. counter names that differ between TUs) is a conflict. A change at a new
+ * site that overlaps a kept change (e.g. the same header preprocessed differently by two TUs)
+ * is a conflict too. Both are dropped, so the first TU in path order wins, every header is
+ * rewritten exactly once, and the kept changes of a file can always be applied together.
+ */
+struct ChangeDeduplicator {
+    // file -> site (offsets and lengths of all replacements) -> replacement texts
+    std::map<std::string, std::map<std::string, std::string>> Sites;
+    // file -> offset -> end and text of every kept replacement
+    struct Claim {
+        unsigned End;
+        std::string Text;
+    };
+    std::map<std::string, std::multimap<unsigned, Claim>> Claims;
+    // file -> longest kept replacement, which bounds how far back an overlap can start
+    std::map<std::string, unsigned> MaxLength;
+    int claimed = 0;
+    int duplicates = 0;
+    int conflicts = 0;
+
+    bool claim(const std::string &File, const AtomicChange &C) {
+        std::string Site, Content;
+        for (const auto &R : C.getReplacements()) {
+            Site += std::to_string(R.getOffset()) + ":" + std::to_string(R.getLength()) + ";";
+            Content += R.getReplacementText().str();
+            Content += '\0';
+        }
+        auto &FileSites = Sites[File];
+        auto Found = FileSites.find(Site);
+        if (Found != FileSites.end()) {
+            if (Found->second == Content)
+                duplicates++;
+            else
+                conflicts++;
+            return false;
+        }
+
+        auto &FileClaims = Claims[File];
+        unsigned &Longest = MaxLength[File];
+        for (const auto &R : C.getReplacements()) {
+            if (overlaps(FileClaims, Longest, R)) {
+                conflicts++;
+                return false;
+            }
+        }
+        for (const auto &R : C.getReplacements()) {
+            FileClaims.insert({R.getOffset(), {R.getOffset() + R.getLength(),
+                                               R.getReplacementText().str()}});
+            Longest = std::max(Longest, R.getLength());
+        }
+        FileSites.emplace(std::move(Site), std::move(Content));
+        claimed++;
+        return true;
+    }
+
+private:
+    // whether R cannot be applied together with the kept replacements, as Replacements::add
+    // decides it: ranges that intersect, an insertion strictly inside a replaced range, or
+    // different insertions at the same offset
+    static bool overlaps(const std::multimap<unsigned, Claim> &FileClaims, unsigned Longest,
+                         const Replacement &R) {
+        unsigned Begin = R.getOffset(), End = Begin + R.getLength();
+        for (auto It = FileClaims.lower_bound(Begin > Longest ? Begin - Longest : 0);
+             It != FileClaims.end() && It->first <= End; ++It) {
+            unsigned ClaimBegin = It->first, ClaimEnd = It->second.End;
+            if (Begin == End && ClaimBegin == ClaimEnd) {
+                if (Begin == ClaimBegin && R.getReplacementText() != It->second.Text)
+                    return true;
+            } else if (Begin == End) {
+                if (ClaimBegin < Begin && Begin < ClaimEnd)
+                    return true;
+            } else if (ClaimBegin == ClaimEnd) {
+                if (Begin < ClaimBegin && ClaimBegin < End)
+                    return true;
+            } else if (ClaimBegin < End && Begin < ClaimEnd) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * Applies Changes to the current content of Path. The file is mapped rather than copied (small
+ * files are read), and unmapped before returning, so the caller may overwrite it.
+ */
+static Expected<std::string> apply_changes_to_file(const std::string &Path,
+                                                   ArrayRef<AtomicChange> Changes) {
+    auto Buffer = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buffer)
+        return errorCodeToError(Buffer.getError());
+    StringRef Code = (*Buffer)->getBuffer();
+    auto ChangedCode = apply_changes(Path, Code, Changes);
+    // hook calls need the runtime's declarations
+    if (ChangedCode && Capture == CaptureMode::Hook && !Changes.empty() &&
+        !Code.contains(hook_include))
+        ChangedCode->insert(0, hook_include);
+    return ChangedCode;
+}
+
+// Writes Data, then Trailer, to Path. Strings larger than the stream buffer go straight to write().
+static bool write_file(StringRef Path, StringRef Data, StringRef Trailer = "") {
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC);
+    if (EC)
+        return false;
+    OS << Data << Trailer;
+    OS.close();
+    if (OS.has_error()) {
+        OS.clear_error();
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Path of File under --out-dir, keeping its path relative to --source-root; empty if File is
+ * outside the root.
+ */
+static std::string mirror_path(StringRef File) {
+    SmallString<256> Root(SourceRoot.empty() ? "." : SourceRoot.getValue());
+    llvm::sys::fs::make_absolute(Root);
+    std::string RootStr = normalize_path(Root);
+    StringRef Rel = File;
+    if (!Rel.consume_front(RootStr))
+        return "";
+    // a prefix of the name, not of the path: /src/foo vs /src/foobar
+    if (!Rel.empty() && !llvm::sys::path::is_separator(Rel[0]) &&
+        !llvm::sys::path::is_separator(RootStr.back()))
+        return "";
+    SmallString<256> Out(OutDir.getValue());
+    llvm::sys::path::append(Out, llvm::sys::path::relative_path(Rel));
+    return std::string(Out.str());
+}
+
+// Returns false on errors; Written tells whether the file had to be (re)written.
+static bool write_if_changed(const std::string &Path, StringRef Data, bool &Written) {
+    Written = false;
+    auto Existing = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    // same bytes: keep the old file, and its mtime, so build systems do not rebuild it
+    if (Existing && (*Existing)->getBuffer() == Data)
+        return true;
+    if (llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path)))
+        return false;
+    Written = true;
+    return write_atomically(Path, Data);
+}
+
+static void write_phase(json::OStream &J, StringRef Name, const PhaseTime &T) {
+    J.attributeObject(Name, [&] {
+        J.attribute("wall", T.wall);
+        J.attribute("cpu", T.cpu);
+    });
+}
+
+static void write_phases(json::OStream &J, const PhaseTimes &T) {
+    write_phase(J, "load", T.load);
+    write_phase(J, "parse", T.parse);
+    write_phase(J, "match", T.match);
+    write_phase(J, "edits", T.edits);
+    write_phase(J, "consumer", T.consumer);
+    write_phase(J, "apply", T.apply);
+    write_phase(J, "write", T.write);
+}
+
+// one line on stderr with the wall time of each phase; per-TU phases are summed over all workers
+static void print_phase_times() {
+    PhaseTimes Total = Times;
+    for (const auto &Entry : Results)
+        Total += Entry.second.times;
+    llvm::errs() << "Phase times: load " << llvm::format("%.6f", Total.load.wall) << "s, parse "
+                 << llvm::format("%.6f", Total.parse.wall) << "s, match "
+                 << llvm::format("%.6f", Total.match.wall) << "s, edits "
+                 << llvm::format("%.6f", Total.edits.wall) << "s, consumer "
+                 << llvm::format("%.6f", Total.consumer.wall) << "s, apply "
+                 << llvm::format("%.6f", Total.apply.wall) << "s, write "
+                 << llvm::format("%.6f", Total.write.wall) << "s\n";
+}
+
+/**
+ * The --stats report. Per-TU phases are summed over all workers, so with -j their wall time
+ * can exceed the run's. Cached TUs contribute their changes, but no times or rule matches.
+ */
+static void write_stats(const std::string &Path, const std::map<std::string, AtomicChanges> &Buckets,
+                        const ChangeDeduplicator &Dedup, int failed_files) {
+    PhaseTimes Total = Times;
+    std::map<std::string, int> RuleCounts;
+    int failed = 0, hot = 0;
+    for (const auto &Entry : Results) {
+        Total += Entry.second.times;
+        failed += Entry.second.failed_changes;
+        hot += Entry.second.hot_conditions;
+        for (const auto &Count : Entry.second.rule_counts)
+            RuleCounts[Count.first] += Count.second;
+    }
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        llvm::errs() << "Cannot write " << Path << ": " << EC.message() << "\n";
+        return;
+    }
+    json::OStream J(OS, /*IndentSize=*/2);
+    J.object([&] {
+        if (!Shard.empty())
+            J.attribute("shard", Shard.getValue());
+        J.attribute("files", static_cast<int64_t>(Buckets.size()));
+        J.attribute("changes", Dedup.claimed);
+        J.attribute("failed_changes", failed);
+        J.attribute("failed_files", failed_files);
+        J.attribute("hot_conditions", hot);
+        J.attribute("apply_conflicts", apply_conflicts);
+        J.attribute("duplicate_changes", Dedup.duplicates);
+        J.attribute("conflicting_changes", Dedup.conflicts);
+        J.attributeObject("phases", [&] { write_phases(J, Total); });
+        J.attributeObject("rules", [&] {
+            for (const auto &Name : rule_names)
+                J.attribute(Name, RuleCounts[Name]);
+        });
+        J.attributeObject("edits_per_file", [&] {
+            for (const auto &Entry : Buckets)
+                J.attribute(Entry.first, static_cast<int64_t>(Entry.second.size()));
+        });
+        J.attributeObject("tus", [&] {
+            for (const auto &Entry : Results) {
+                const FileResult &R = Entry.second;
+                J.attributeObject(Entry.first, [&] {
+                    J.attribute("cached", R.cached);
+                    J.attribute("changes", R.changes_count);
+                    J.attributeObject("phases", [&] {
+                        write_phase(J, "parse", R.times.parse);
+                        write_phase(J, "match", R.times.match);
+                        write_phase(J, "edits", R.times.edits);
+                        write_phase(J, "consumer", R.times.consumer);
+                    });
+                });
+            }
+        });
+    });
+    OS << "\n";
+}
+
+/**
+ * Keeps the sources of shard i of N. Sources are assigned largest first, each to the shard
+ * with the fewest bytes so far (ties go to the lower shard, equal sizes are ordered by path),
+ * so all shards compute the same partition from the same sources, without talking to each other.
+ */
+static bool select_shard(std::vector<std::string> &Sources) {
+    StringRef Index, Count;
+    std::tie(Index, Count) = StringRef(Shard).split('/');
+    unsigned I, N;
+    if (Index.getAsInteger(10, I) || Count.getAsInteger(10, N) || N == 0 || I >= N) {
+        llvm::errs() << "--shard expects i/N with 0 <= i < N, got " << Shard << "\n";
+        return false;
+    }
+
+    std::vector<std::pair<uint64_t, std::string>> Sized;
+    for (const auto &Path : Sources) {
+        uint64_t Size = 0;
+        llvm::sys::fs::file_size(getAbsolutePath(Path), Size);
+        Sized.emplace_back(Size, Path);
+    }
+    std::sort(Sized.begin(), Sized.end(), [](const std::pair<uint64_t, std::string> &A,
+                                             const std::pair<uint64_t, std::string> &B) {
+        return A.first != B.first ? A.first > B.first : A.second < B.second;
+    });
+    Sized.erase(std::unique(Sized.begin(), Sized.end()), Sized.end());
+
+    std::vector<uint64_t> Load(N, 0);
+    std::vector<std::string> Selected;
+    for (auto &Entry : Sized) {
+        size_t Lightest = std::min_element(Load.begin(), Load.end()) - Load.begin();
+        // empty files still cost a parse
+        Load[Lightest] += std::max<uint64_t>(Entry.first, 1);
+        if (Lightest == I)
+            Selected.push_back(std::move(Entry.second));
+    }
+    Sources = std::move(Selected);
+    return true;
+}
+
+
+/**************** Server mode ****************/
+
+/**
+ * Handles one --serve request:
+ *   {"file": "<source>", "out": "<path>", "changed": ["<path>", ...], "refresh": true}
+ * Only "file" is required. The rewritten source goes to "out" if given and is returned inline
+ * otherwise; other touched files (headers) are always returned inline. "changed" lists files,
+ * besides the source, that changed since the last request; "refresh" forgets all cached stats.
+ */
+static json::Value serve_request(const CompilationDatabase &Compilations, StringRef Line) {
+    auto Parsed = json::parse(Line);
+    if (!Parsed)
+        return json::Object{{"error", toString(Parsed.takeError())}};
+    const json::Object *Req = Parsed->getAsObject();
+    llvm::Optional<StringRef> File = Req ? Req->getString("file") : llvm::None;
+    if (!File)
+        return json::Object{{"error", "request needs a \"file\""}};
+
+    if (Req->getBoolean("refresh").getValueOr(false))
+        ServeFS->clear();
+    if (const json::Array *Changed = Req->getArray("changed"))
+        for (const json::Value &Path : *Changed)
+            if (auto P = Path.getAsString())
+                ServeFS->invalidate(*P);
+
+    std::string Source = normalize_path(SmallString<256>(getAbsolutePath(*File)));
+    ServeFS->invalidate(Source);
+    {
+        std::lock_guard<std::mutex> Lock(ResultsMutex);
+        Results.erase(Source);
+    }
+    if (run_on_source(Compilations, Source) != 0)
+        return json::Object{{"file", Source}, {"error", "parsing failed"}};
+
+    FileResult R;
+    {
+        std::lock_guard<std::mutex> Lock(ResultsMutex);
+        R = std::move(Results[Source]);
+        Results.erase(Source);
+    }
+    R.ChangesByFile[Source];
+
+    json::Array Files;
+    for (auto &Entry : R.ChangesByFile) {
+        const std::string &Path = Entry.first;
+        auto ChangedCode = apply_changes_to_file(Path, Entry.second);
+        if (!ChangedCode)
+            return json::Object{{"file", Source}, {"error", toString(ChangedCode.takeError())}};
+
+        json::Object Result{{"path", Path}, {"changes", static_cast<int64_t>(Entry.second.size())}};
+        llvm::Optional<StringRef> Out = Req->getString("out");
+        if (Out && Path == Source) {
+            if (!write_atomically(Out->str(), *ChangedCode))
+                return json::Object{{"file", Source}, {"error", "cannot write " + Out->str()}};
+            Result["out"] = Out->str();
+        } else {
+            Result["code"] = std::move(*ChangedCode);
+        }
+        Files.push_back(std::move(Result));
+    }
+    return json::Object{{"file", Source}, {"changes", R.changes_count}, {"files", std::move(Files)}};
+}
+
+/**
+ * Answers newline-separated requests from In on Out until In is closed, or until a reply cannot
+ * be written because the client went away. The write error is cleared, so that only this
+ * stream ends and not the daemon.
+ */
+static void serve_stream(const CompilationDatabase &Compilations, int In, int Out) {
+    raw_fd_ostream OS(Out, /*shouldClose=*/false, /*unbuffered=*/false);
+    std::string Pending;
+    char Buffer[4096];
+    ssize_t N;
+    while ((N = read(In, Buffer, sizeof(Buffer))) > 0) {
+        Pending.append(Buffer, N);
+        size_t End;
+        while ((End = Pending.find('\n')) != std::string::npos) {
+            std::string Line = Pending.substr(0, End);
+            Pending.erase(0, End + 1);
+            if (StringRef(Line).trim().empty())
+                continue;
+            OS << serve_request(Compilations, Line) << "\n";
+            OS.flush();
+            if (OS.has_error()) {
+                llvm::errs() << "Cannot send reply: " << OS.error().message() << "\n";
+                OS.clear_error();
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * The compilation database, the matchers and the stat cache stay loaded between requests.
+ * Requests are handled one at a time.
+ */
+static int serve(const CompilationDatabase &Compilations) {
+    ServeFS = new StatCacheFS(llvm::vfs::createPhysicalFileSystem());
+    // a client that disconnects mid-reply must not kill the daemon; the write fails instead
+    signal(SIGPIPE, SIG_IGN);
+    if (ServeSocket.empty()) {
+        serve_stream(Compilations, STDIN_FILENO, STDOUT_FILENO);
+        return 0;
+    }
+
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    if (ServeSocket.size() >= sizeof(Addr.sun_path)) {
+        llvm::errs() << "Socket path too long: " << ServeSocket << "\n";
+        return 1;
+    }
+    strncpy(Addr.sun_path, ServeSocket.c_str(), sizeof(Addr.sun_path) - 1);
+    // replace a stale socket from an earlier run, but nothing else
+    struct stat Existing;
+    if (lstat(ServeSocket.c_str(), &Existing) == 0) {
+        if (!S_ISSOCK(Existing.st_mode)) {
+            llvm::errs() << ServeSocket << " exists and is not a socket\n";
+            return 1;
+        }
+        unlink(ServeSocket.c_str());
+    }
+    int Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Sock < 0 || bind(Sock, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) != 0 ||
+        listen(Sock, /*backlog=*/16) != 0) {
+        llvm::errs() << "Cannot listen on " << ServeSocket << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    while (true) {
+        int Conn = accept(Sock, nullptr, nullptr);
+        if (Conn < 0) {
+            if (errno == EINTR)
+                continue;
+            llvm::errs() << "accept() failed: " << strerror(errno) << "\n";
+            break;
+        }
+        serve_stream(Compilations, Conn, Conn);
+        close(Conn);
+    }
+    close(Sock);
+    unlink(ServeSocket.c_str());
+    return 1;
+}
+
+/**************** Server mode END ****************/
+
+
+int main(int argc, const char **argv) {
+    // sources are optional: without them, every file in the compilation database is rewritten
+    PhaseTimer LoadTimer(Times.load);
+    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ReCondCategory, cl::ZeroOrMore);
+    if (!ExpectedParser) {
+        // Fail gracefully for unsupported options.
+        llvm::errs() << ExpectedParser.takeError();
+        return 1;
+    }
+    CommonOptionsParser& OptionsParser = ExpectedParser.get();
+    const CompilationDatabase &Compilations = OptionsParser.getCompilations();
+    std::vector<std::string> Sources = OptionsParser.getSourcePathList();
+    if (Sources.empty())
+        Sources = Compilations.getAllFiles();
+    LoadTimer.stop();
+
+    if (!Shard.empty()) {
+        if (!select_shard(Sources))
+            return 1;
+        // counter names restart in every TU, so two shards would edit a shared header
+        // differently; stable names make their edits identical
+        if (Naming.getNumOccurrences() && Naming == NamingMode::Counter)
+            llvm::errs() << "warning: with --naming=counter, shards may conflict on shared headers\n";
+        else
+            Naming = NamingMode::Stable;
+    }
+
+    if (!compile_header_filter() || !compile_function_filter() || !load_profiles() ||
+        !load_changed_lines())
+        return 1;
+    if (InPlace && !OutDir.empty()) {
+        llvm::errs() << "-i and --out-dir cannot be combined\n";
+        return 1;
+    }
+    if (!ExportFixesDir.empty()) {
+        if (std::error_code EC = llvm::sys::fs::create_directories(ExportFixesDir)) {
+            llvm::errs() << "Cannot create " << ExportFixesDir << ": " << EC.message() << "\n";
+            return 1;
+        }
+    }
+
+    if (!PCHHeader.empty()) {
+        PCHHeader = getAbsolutePath(PCHHeader);
+        auto Buffer = MemoryBuffer::getFile(PCHHeader);
+        if (!Buffer) {
+            llvm::errs() << "Cannot read prefix header " << PCHHeader << ": "
+                         << Buffer.getError().message() << "\n";
+            return 1;
+        }
+        PCHKey = PCHHeader + ":" + llvm::utohexstr(xxHash64((*Buffer)->getBuffer()));
+        if (std::error_code EC = llvm::sys::fs::createUniqueDirectory("rewritecond-pch", PCHDir)) {
+            llvm::errs() << "Cannot create a directory for PCHs: " << EC.message() << "\n";
+            return 1;
+        }
+    }
+
+    if (Serve || !ServeSocket.empty())
+        return serve(Compilations);
+
+    // with --diff, sources without changed lines are emitted unchanged without being parsed,
+    // unless a changed header may be rewritten: any of them could include it
+    std::vector<std::string> ToParse;
+    if (diff_active()) {
+        llvm::StringSet<> SourceSet;
+        for (const auto &Path : Sources)
+            SourceSet.insert(normalize_path(SmallString<256>(getAbsolutePath(Path))));
+        bool HeaderChanged = false;
+        for (const auto &Entry : ChangedLines)
+            if (!SourceSet.count(Entry.first()) && header_allowed(Entry.first()))
+                HeaderChanged = true;
+        for (const auto &Path : Sources)
+            if (HeaderChanged ||
+                ChangedLines.count(normalize_path(SmallString<256>(getAbsolutePath(Path)))))
+                ToParse.push_back(Path);
+        std::cerr << "Parsing " << ToParse.size() << " of " << Sources.size()
+                  << " sources touched by the diff" << std::endl;
+    } else {
+        ToParse = Sources;
+    }
+
+    // the profiler is per thread; the main thread's instance collects the workers' at the end
+    if (!TimeTraceFile.empty())
+        timeTraceProfilerInitialize(TimeTraceGranularity, "rewritecond");
+
+    if (Jobs == 1) {
+        for (const auto &Path : ToParse)
+            run_on_source(Compilations, Path);
+    } else {
+        llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+        for (const auto &Path : ToParse)
+            Pool.async([&Compilations, Path] {
+                if (!TimeTraceFile.empty())
+                    timeTraceProfilerInitialize(TimeTraceGranularity, "rewritecond");
+                run_on_source(Compilations, Path);
+                // hand this task's events over to the main thread's profiler
+                if (!TimeTraceFile.empty())
+                    timeTraceProfilerFinishThread();
+            });
+        Pool.wait();
+    }
+
+    // bucket changes by the file they edit, merging per-source results in path order;
+    // listed sources are always emitted, even without changes
+    std::map<std::string, AtomicChanges> Buckets;
+    for (const auto &Path : Sources)
+        Buckets[normalize_path(SmallString<256>(getAbsolutePath(Path)))];
+    ChangeDeduplicator Dedup;
+    for (auto &Entry : Results) {
+        for (auto &FileChanges : Entry.second.ChangesByFile) {
+            AtomicChanges &Bucket = Buckets[FileChanges.first];
+            for (auto &C : FileChanges.second)
+                if (Dedup.claim(FileChanges.first, C))
+                    Bucket.push_back(std::move(C));
+        }
+    }
+    int total_changes = Dedup.claimed;
+    if (Dedup.duplicates || Dedup.conflicts)
+        std::cerr << "Dropped " << Dedup.duplicates << " duplicate and " << Dedup.conflicts
+                  << " conflicting changes to files shared between TUs" << std::endl;
+
+    if (!InPlace && OutDir.empty() && ExportFixesDir.empty() && !OutputFileName.empty() &&
+        Buckets.size() > 1) {
+        llvm::errs() << "-o needs exactly one file to rewrite, but " << Buckets.size()
+                     << " files are touched; use -i to rewrite them in place\n";
+        return 1;
+    }
+
+    int status = 0;
+    if (Capture == CaptureMode::Hook && !check_hook_sites(Buckets))
+        status = 1;
+    int failed_files = 0;
+    int written_files = 0, unchanged_files = 0;
+    for (auto &Entry : Buckets) {
+        const std::string &Path = Entry.first;
+        // exported changes are applied later, by clang-apply-replacements
+        if (!ExportFixesDir.empty())
+            break;
+        // nothing to write back for untouched files
+        if (InPlace && Entry.second.empty())
+            continue;
+
+        PhaseTimer ApplyTimer(Times.apply);
+        auto ChangedCode = apply_changes_to_file(Path, Entry.second);
+        ApplyTimer.stop();
+        if (!ChangedCode) {
+            llvm::errs() << "Applying changes to " << Path << " failed: "
+                         << llvm::toString(ChangedCode.takeError()) << "\n";
+            status = 1;
+            failed_files++;
+            continue;
+        }
+
+        // write out result
+        PhaseTimer WriteTimer(Times.write);
+        llvm::TimeTraceScope WriteScope("Write", Path);
+        if (InPlace) {
+            if (!write_file(Path, ChangedCode.get())) {
+                llvm::errs() << "Cannot write " << Path << "\n";
+                status = 1;
+            }
+            continue;
+        }
+        if (!OutDir.empty()) {
+            std::string OutPath = mirror_path(Path);
+            bool Written;
+            if (OutPath.empty()) {
+                llvm::errs() << Path << " is outside the source root; not written\n";
+                status = 1;
+            } else if (!write_if_changed(OutPath, ChangedCode.get(), Written)) {
+                llvm::errs() << "Cannot write " << OutPath << "\n";
+                status = 1;
+            } else {
+                (Written ? written_files : unchanged_files)++;
+            }
+            continue;
+        }
+        if (!OutputFileName.empty()) { // write to file
+            if (write_file(OutputFileName, ChangedCode.get(), "\n"))   // can write - good path
+                continue;
+        }
+        // write to stdout, if fails to write to file; buffered, without a flush per file
+        if (Buckets.size() > 1)
+            llvm::outs() << "// ==== " << Path << " ====\n";
+        else
+            std::cerr << "File operation failed / file not specified. Writing to stdout ..." << std::endl;
+        llvm::outs() << ChangedCode.get() << "\n";
+    }
+
+    if (!PCHDir.empty())
+        llvm::sys::fs::remove_directories(PCHDir);
+
+    if (!StatsFile.empty())
+        write_stats(StatsFile, Buckets, Dedup, failed_files);
+    if (timeTraceProfilerEnabled()) {
+        if (auto Err = timeTraceProfilerWrite(TimeTraceFile, TimeTraceFile)) {
+            llvm::errs() << "Cannot write " << TimeTraceFile << ": " << toString(std::move(Err)) << "\n";
+            status = 1;
         }
+        timeTraceProfilerCleanup();
     }
-    // write to stdout, if fails to write to file
-    std::cerr << "File operation failed / file not specified. Writing to stdout ..." << std::endl;
-    std::cout << ChangedCode.get() << std::endl;
 
-    std::cerr << "Successfully applied " << changes_count << " changes!" << std::endl;
-    // std::cout << toString(ChangedCode.takeError()) << std::endl;
+    if (!ExportFixesDir.empty())
+        std::cerr << "Exported " << total_changes << " changes to " << ExportFixesDir << std::endl;
+    else
+        std::cerr << "Successfully applied " << total_changes << " changes!" << std::endl;
+    if (!OutDir.empty())
+        std::cerr << "Wrote " << written_files << " files to " << OutDir << ", " << unchanged_files
+                  << " already up to date" << std::endl;
+    if (!CacheDir.empty())
+        std::cerr << "Cache: " << cache_hits << " hits, " << cache_misses << " misses" << std::endl;
+    print_phase_times();
+    return status;
 }
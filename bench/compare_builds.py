@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Compares builds of rewritecond on startup time and per-TU throughput.
+
+Startup is the median wall time of rewriting an empty C file, which is dominated by process
+start, option parsing and clang's setup. Throughput is source files per second over the
+benchmark inputs (single job, --out-dir into a scratch directory). The first tool is the
+reference; every other tool is reported relative to it.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def timed(cmd):
+    start = time.perf_counter()
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return time.perf_counter() - start
+
+
+def startup(tool, repeat):
+    work = tempfile.mkdtemp(prefix="rewritecond-startup-")
+    try:
+        empty = os.path.join(work, "empty.c")
+        open(empty, "w").close()
+        return statistics.median(timed([tool, empty, "-o", os.path.join(work, "out.c"), "--"])
+                                 for _ in range(repeat))
+    finally:
+        shutil.rmtree(work)
+
+
+def throughput(tool, inputs, repeat):
+    with open(os.path.join(inputs, "compile_commands.json")) as fp:
+        tus = len(json.load(fp))
+    seconds = []
+    for _ in range(repeat):
+        work = tempfile.mkdtemp(prefix="rewritecond-tput-")
+        try:
+            seconds.append(timed([tool, "-p", inputs, "--source-root", inputs,
+                                  "--out-dir", work]))
+        finally:
+            shutil.rmtree(work)
+    return tus / statistics.median(seconds)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("tools", nargs="+", help="rewritecond executables; the first is the reference")
+    parser.add_argument("--inputs", required=True, help="directory made by gen_inputs.py")
+    parser.add_argument("--out", help="JSON file for the measurements")
+    parser.add_argument("--repeat", type=int, default=5)
+    args = parser.parse_args()
+
+    result = {}
+    for tool in args.tools:
+        result[tool] = {"startup_s": startup(tool, args.repeat),
+                        "tus_per_s": throughput(tool, args.inputs, args.repeat)}
+
+    ref = result[args.tools[0]]
+    print(f"{'build':28} {'startup':>10} {'TUs/s':>10}")
+    for tool in args.tools:
+        r = result[tool]
+        print(f"{tool:28} {r['startup_s'] * 1000:8.1f}ms {r['tus_per_s']:10.1f}"
+              f"   ({ref['startup_s'] / r['startup_s']:.2f}x startup, "
+              f"{r['tus_per_s'] / ref['tus_per_s']:.2f}x throughput)")
+
+    if args.out:
+        with open(args.out, "w") as fp:
+            json.dump(result, fp, indent=2, sort_keys=True)
+            fp.write("\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Generates deterministic C inputs for the benchmark, in the style of examples/test.c.
+
+Each function mixes plain ifs, else-if chains, nested loops and ifs directly under `case`
+labels. The same --seed, --files and --functions always produce byte-identical files. A
+compile_commands.json for them is written next to the sources.
+"""
+
+import argparse
+import json
+import os
+import random
+
+VARS = ["x", "y", "z", "n"]
+
+
+def cond(rng):
+    a, b = rng.sample(VARS, 2)
+    return rng.choice([
+        f"{a} + {rng.randint(1, 9)} > {b}",
+        f"{a} == {b}",
+        f"!({a} == {rng.randint(0, 9)})",
+        f"{a}++ < {rng.randint(10, 99)}",
+        f"({a} & {rng.randint(1, 15)}) != 0",
+    ])
+
+
+def stmt(rng):
+    return f"{rng.choice(VARS)} += {rng.randint(1, 5)};"
+
+
+def plain_if(rng, ind):
+    if rng.random() < 0.5:
+        return [f"{ind}if ({cond(rng)}) {{", f"{ind}    {stmt(rng)}", f"{ind}}}"]
+    return [f"{ind}if ({cond(rng)}) {stmt(rng)}"]
+
+
+def else_if_chain(rng, ind):
+    lines = [f"{ind}if ({cond(rng)}) {{", f"{ind}    {stmt(rng)}"]
+    for _ in range(rng.randint(1, 4)):
+        lines += [f"{ind}}} else if ({cond(rng)}) {{", f"{ind}    {stmt(rng)}"]
+    lines += [f"{ind}}} else {{", f"{ind}    {stmt(rng)}", f"{ind}}}"]
+    return lines
+
+
+def nested_loops(rng, ind):
+    lines = [f"{ind}while ({cond(rng)}) {{"]
+    lines += [f"{ind}    for (i = 0; {cond(rng)}; i++) {{"]
+    lines += plain_if(rng, ind + "        ")
+    lines += [f"{ind}    }}", f"{ind}    if (n++ > 100) break;", f"{ind}}}"]
+    lines += [f"{ind}while ({cond(rng)}) {stmt(rng)}"]
+    lines += [f"{ind}for (i = 0; {cond(rng)}; i++) {stmt(rng)}"]
+    return lines
+
+
+def switch_ifs(rng, ind):
+    lines = [f"{ind}switch ({rng.choice(VARS)}) {{"]
+    for label in range(rng.randint(2, 4)):
+        lines += [f"{ind}case {label}:"]
+        lines += [f"{ind}    if ({cond(rng)}) {stmt(rng)}", f"{ind}    break;"]
+    lines += [f"{ind}default:", f"{ind}    break;", f"{ind}}}"]
+    return lines
+
+
+def function(rng, index):
+    lines = [f"int f{index}(int x, int y) {{", "    int z = x, n = 0, i;"]
+    for _ in range(rng.randint(4, 8)):
+        lines += rng.choice([plain_if, else_if_chain, nested_loops, switch_ifs])(rng, "    ")
+    lines += ["    return x + y + z + n;", "}", ""]
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--out", required=True, help="directory for the sources")
+    parser.add_argument("--files", type=int, default=20)
+    parser.add_argument("--functions", type=int, default=200, help="functions per file")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    out = os.path.abspath(args.out)
+    os.makedirs(out, exist_ok=True)
+    rng = random.Random(args.seed)
+    commands = []
+    for f in range(args.files):
+        name = f"bench_{f:03d}.c"
+        lines = []
+        for i in range(args.functions):
+            lines += function(rng, f * args.functions + i)
+        with open(os.path.join(out, name), "w") as fp:
+            fp.write("\n".join(lines))
+        commands.append({"directory": out, "file": name, "command": f"clang -c {name}"})
+    with open(os.path.join(out, "compile_commands.json"), "w") as fp:
+        json.dump(commands, fp, indent=2)
+
+
+if __name__ == "__main__":
+    main()
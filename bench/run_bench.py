@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Runs rewritecond over the generated inputs and compares the phase timings to a baseline.
+
+Every engine is run --repeat times on a fresh copy of the inputs (the tool rewrites them with
+-i), and the median wall time of each phase from --stats is kept. The result is written as JSON. With
+--baseline, the run fails if the number of changes differs from the baseline, or if a phase is
+slower than the baseline by more than --tolerance (and by more than --min-delta seconds, so
+that noise in very short phases is ignored). A missing baseline is recorded from this run, with
+a warning. With --record, the result becomes the new baseline.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+ENGINES = ["matchers", "visitor"]
+PHASES = ["load", "parse", "match", "edits", "consumer", "apply", "write"]
+
+
+def run_once(tool, inputs, engine, jobs):
+    work = tempfile.mkdtemp(prefix="rewritecond-bench-")
+    try:
+        src = os.path.join(work, "src")
+        shutil.copytree(inputs, src)
+        # the compile commands name the generated directory; point them at the copy
+        db_path = os.path.join(src, "compile_commands.json")
+        with open(db_path) as fp:
+            db = json.load(fp)
+        for entry in db:
+            entry["directory"] = src
+        with open(db_path, "w") as fp:
+            json.dump(db, fp)
+
+        stats_path = os.path.join(work, "stats.json")
+        subprocess.run([tool, "-p", src, "-i", f"-j={jobs}", f"--engine={engine}",
+                        f"--stats={stats_path}"],
+                       check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open(stats_path) as fp:
+            stats = json.load(fp)
+        run = {phase: stats["phases"][phase]["wall"] for phase in PHASES}
+        run.update(files=stats["files"], changes=stats["changes"])
+        return run
+    finally:
+        shutil.rmtree(work)
+
+
+def measure(args):
+    result = {}
+    for engine in ENGINES:
+        runs = [run_once(args.tool, args.inputs, engine, args.jobs) for _ in range(args.repeat)]
+        result[engine] = {"files": runs[0]["files"], "changes": runs[0]["changes"]}
+        for phase in PHASES:
+            result[engine][phase] = statistics.median(r[phase] for r in runs)
+    return result
+
+
+def compare(result, baseline, tolerance, min_delta):
+    failures = []
+    for engine in ENGINES:
+        if engine not in baseline:
+            continue
+        cur, base = result[engine], baseline[engine]
+        if cur["changes"] != base["changes"]:
+            failures.append(f"{engine}: {cur['changes']} changes, baseline {base['changes']}")
+        for phase in PHASES:
+            delta = cur[phase] - base[phase]
+            if delta > min_delta and delta > base[phase] * tolerance:
+                pct = f" (+{delta / base[phase]:.0%})" if base[phase] else ""
+                failures.append(f"{engine}: {phase} {cur[phase]:.3f}s, "
+                                f"baseline {base[phase]:.3f}s{pct}")
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--tool", required=True, help="rewritecond executable")
+    parser.add_argument("--inputs", required=True, help="directory made by gen_inputs.py")
+    parser.add_argument("--out", required=True, help="JSON file for this run's result")
+    parser.add_argument("--baseline", help="baseline JSON to compare against")
+    parser.add_argument("--record", help="also write the result to this baseline file")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--jobs", type=int, default=1)
+    parser.add_argument("--tolerance", type=float, default=0.10)
+    parser.add_argument("--min-delta", type=float, default=0.005)
+    args = parser.parse_args()
+
+    result = measure(args)
+    for path in [args.out, args.record]:
+        if path:
+            with open(path, "w") as fp:
+                json.dump(result, fp, indent=2, sort_keys=True)
+                fp.write("\n")
+
+    for engine in ENGINES:
+        r = result[engine]
+        print(f"{engine:9} {r['changes']:6} changes  " +
+              "  ".join(f"{phase} {r[phase]:.3f}s" for phase in PHASES))
+
+    if args.record or not args.baseline:
+        return 0
+    if not os.path.exists(args.baseline):
+        # timings only compare on one machine, so none is checked in; the first run sets it
+        with open(args.baseline, "w") as fp:
+            json.dump(result, fp, indent=2, sort_keys=True)
+            fp.write("\n")
+        print(f"warning: no baseline at {args.baseline}; recorded this run as the baseline",
+              file=sys.stderr)
+        return 0
+    with open(args.baseline) as fp:
+        failures = compare(result, json.load(fp), args.tolerance, args.min_delta)
+    for failure in failures:
+        print("REGRESSION " + failure, file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,104 @@
+#include <stdio.h>
+
+// Every kind of conditional the rules handle, in a program that prints what it computed, so that
+// the rewritten program can be run and its output compared with the original's.
+
+static int classify(int x) {
+    // else-if chain
+    if (x < 0) {
+        return -1;
+    } else if (x == 0) {
+        return 0;
+    } else if (x % 2 == 0) {
+        return 2;
+    } else {
+        return 1;
+    }
+}
+
+static int nested(int x, int y) {
+    // nested if, but ast looks like else-if
+    if (x > y)
+        if (x > 2 * y)
+            return 2;
+
+    // nested if with braces
+    if (x == y) {
+        x++;
+        if (x != 3) {
+            return x;
+        }
+    }
+
+    // single-statement body on the same line
+    if (!(y == 22)) return 1;
+    return 0;
+}
+
+static int loops(int n) {
+    int sum = 0, i, j = 0;
+
+    // while with a compound body and a continue
+    i = 0;
+    while (i < n) {
+        i++;
+        if (i % 3 == 0)
+            continue;
+        sum += i;
+    }
+
+    // while with a single-statement body
+    while (j * j < n) j++;
+    sum += j;
+
+    // for with a declaration, and for without one
+    for (int k = 0; k < n; k += 2) {
+        sum += k;
+    }
+    for (i = n; i > 0 && sum % 7 != 0; i--) {
+        sum++;
+    }
+
+    // for with a null statement body
+    for (i = 0; i * 3 < n; ++i);
+    sum += i;
+
+    // for with an empty condition is left alone
+    for (i = 0; ; i++) {
+        if (i >= n)
+            break;
+    }
+    return sum + i;
+}
+
+static int cases(int a, int b) {
+    int f = 0;
+    switch (a) {
+        // case without {}, immediately followed by `if`
+        case 1:
+            if (b > 0) return 10;
+            f = 1;
+        case 2: {
+            if (a == b) {
+                f += 2;
+            }
+        }
+        default:
+            return f;
+    }
+}
+
+int main() {
+    int x, y;
+    for (x = -2; x <= 5; x++)
+        printf("classify(%d) = %d\n", x, classify(x));
+    for (x = 0; x < 6; x++)
+        for (y = 0; y < 4; y++)
+            printf("nested(%d, %d) = %d\n", x, y, nested(x, y));
+    for (x = 0; x < 20; x += 3)
+        printf("loops(%d) = %d\n", x, loops(x));
+    for (x = 0; x < 4; x++)
+        for (y = -1; y < 3; y++)
+            printf("cases(%d, %d) = %d\n", x, y, cases(x, y));
+    return 0;
+}
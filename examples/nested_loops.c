@@ -0,0 +1,35 @@
+#include <stdio.h>
+
+// Single-statement bodies that end at the same place as their enclosing statement. The rules
+// insert a closing } after each of them at the same offset.
+
+int main() {
+    int n = 0, i, j, k;
+
+    // nested single-statement for loops on separate lines
+    for (i = 0; i < 4; i++)
+        for (j = 0; j < 3; j++)
+            n += i * j;
+
+    // three levels on one line
+    for (i = 0; i < 2; i++) for (j = 0; j < 2; j++) for (k = 0; k < 2; k++) n++;
+
+    // single-statement while around an else-if chain
+    i = 0;
+    while (i < 6)
+        if (i++ % 3 == 0)
+            n += 1;
+        else if (i % 3 == 1)
+            n += 10;
+        else
+            n += 100;
+
+    // while around a single-statement for
+    j = 0;
+    while (j < 3)
+        for (k = j++; k < 3; k++)
+            n += k;
+
+    printf("%d\n", n);
+    return 0;
+}
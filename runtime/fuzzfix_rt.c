@@ -0,0 +1,50 @@
+/*
+ * Runtime for code rewritten with `rewritecond --capture=hook`; see fuzzfix_rt.h.
+ */
+#include "fuzzfix_rt.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/shm.h>
+
+__thread int32_t *__fuzzfix_row;
+
+/* used when no fuzzer provides shared memory */
+static struct fuzzfix_table local_table;
+static struct fuzzfix_table *table;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+/* the fuzzer's segment, or NULL if there is none or it is too small for the table */
+static struct fuzzfix_table *shared_table(void) {
+    const char *id = getenv(FUZZFIX_SHM_ENV);
+    if (!id)
+        return NULL;
+    int shm_id = atoi(id);
+    struct shmid_ds ds;
+    if (shmctl(shm_id, IPC_STAT, &ds) != 0 || ds.shm_segsz < sizeof(struct fuzzfix_table))
+        return NULL;
+    void *mem = shmat(shm_id, NULL, 0);
+    return mem == (void *)-1 ? NULL : (struct fuzzfix_table *)mem;
+}
+
+static void attach_table(void) {
+    struct fuzzfix_table *t = shared_table();
+    if (!t)
+        t = &local_table;
+    /* the fuzzer may create the segment zeroed; the header tells it the layout we use */
+    t->magic = FUZZFIX_MAGIC;
+    t->sites = FUZZFIX_SITES;
+    t->rows = FUZZFIX_ROWS;
+    /* rows claimed by an earlier process attached to a persistent segment are free again */
+    __atomic_store_n(&t->next_row, 0, __ATOMIC_RELAXED);
+    table = t;
+}
+
+int32_t *__fuzzfix_claim_row(void) {
+    pthread_once(&table_once, attach_table);
+    uint32_t row = __atomic_fetch_add(&table->next_row, 1, __ATOMIC_RELAXED);
+    if (row >= FUZZFIX_ROWS)
+        row = FUZZFIX_ROWS - 1;
+    __fuzzfix_row = table->values[row];
+    return __fuzzfix_row;
+}
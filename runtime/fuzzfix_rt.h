@@ -0,0 +1,60 @@
+/*
+ * Runtime for code rewritten with `rewritecond --capture=hook`.
+ *
+ * Every rewritten condition becomes `__fuzzfix_cond(site, !!(cond))`, which stores the truth
+ * value of `cond` at `site` in the calling thread's row of a table and returns it unchanged. The table
+ * lives in SysV shared memory when the fuzzer passes its id in FUZZFIX_SHM_ENV, and in process
+ * memory otherwise. Recording is one thread-local load and one store: rows are handed out once
+ * per thread, so no locks or atomics are needed on the hot path.
+ *
+ * The segment must hold at least sizeof(struct fuzzfix_table) bytes; a smaller one is not used.
+ * Each process that attaches starts handing out rows from row 0 again, so a persistent segment
+ * can be reused across executions. A fuzzer that runs several executions in one process (e.g.
+ * persistent mode) must set `next_row` to 0 itself before each of them.
+ */
+#ifndef FUZZFIX_RT_H
+#define FUZZFIX_RT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sites per row, a power of two; site ids are reduced modulo this. Two sites in the same slot
+ * overwrite each other; rewritecond warns about them and lists every slot with --site-map.
+ * Both sizes are fixed: the inline hook and the prebuilt runtime must agree on them.
+ */
+#define FUZZFIX_SITES 65536
+
+/* rows, i.e. threads with a row of their own; later threads share the last row */
+#define FUZZFIX_ROWS 16
+
+#define FUZZFIX_SHM_ENV "__FUZZFIX_SHM_ID"
+#define FUZZFIX_MAGIC 0x31584646u /* "FFX1" */
+
+struct fuzzfix_table {
+    uint32_t magic;
+    uint32_t sites;
+    uint32_t rows;
+    uint32_t next_row; /* rows handed out since a process attached, may exceed `rows` */
+    int32_t values[FUZZFIX_ROWS][FUZZFIX_SITES];
+};
+
+extern __thread int32_t *__fuzzfix_row;
+int32_t *__fuzzfix_claim_row(void);
+
+static inline int __fuzzfix_cond(uint32_t site, int value) {
+    int32_t *row = __fuzzfix_row;
+    if (__builtin_expect(row == 0, 0))
+        row = __fuzzfix_claim_row();
+    row[site & (FUZZFIX_SITES - 1)] = value;
+    return value;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FUZZFIX_RT_H */
@@ -0,0 +1,828 @@
+#!/usr/bin/env python3
+"""End-to-end checks of rewritecond.
+
+Each check runs the tool in its own scratch directory, on the examples or on small trees it
+writes itself, and compares the output with what the option it covers promises. --only runs a
+subset. Exits non-zero if any check fails.
+"""
+
+import argparse
+import itertools
+import json
+import os
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# the declaration of a condition variable, in every loop and naming mode
+CONDITION_VAR = re.compile(r"\bint __fuzzfix\w*")
+# the exit test break mode adds to a loop body
+LOOP_BREAK = re.compile(r"if \(!__fuzzfix\w*\) break;")
+# the line printed before each file when several are written to stdout
+FILE_HEADER = re.compile(r"^// ==== (.*) ====$", re.M)
+
+# the options every example is rewritten with, in every combination
+ENGINES = ["matchers", "visitor"]
+LOOP_MODES = ["break", "inline"]
+FORMATS = ["all", "edits", "none"]
+APPLY = ["replacements", "linear"]
+
+CHECKS = []
+failures = []
+
+
+def check(func):
+    CHECKS.append(func)
+    return func
+
+
+def fail(message):
+    failures.append(message)
+    print("FAIL " + message, file=sys.stderr)
+
+
+def run_tool(args, options, cwd=None, input=None):
+    return subprocess.run([args.tool] + options, cwd=cwd, input=input, stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE, text=True, timeout=300)
+
+
+def read(path):
+    with open(path) as fp:
+        return fp.read()
+
+
+def write_tree(root, files):
+    for name, code in files.items():
+        path = os.path.join(root, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "w") as fp:
+            fp.write(code)
+
+
+def compile_code(compiler, sources, output, flags=()):
+    """Compiles (with -c) or links sources; returns the compiler's errors, or None. The flags
+    come after the sources, so that they can name libraries."""
+    proc = subprocess.run([compiler, "-w", "-o", output] + list(sources) + list(flags),
+                          stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    return proc.stdout if proc.returncode != 0 else None
+
+
+def compile_and_run(compiler, sources, work, name, flags=(), env=None):
+    """The program's output and None, or None and the compiler's errors."""
+    exe = os.path.join(work, name)
+    error = compile_code(compiler, sources, exe, flags)
+    if error:
+        return None, error
+    proc = subprocess.run([exe], stdout=subprocess.PIPE, text=True, timeout=30, env=env)
+    return proc.stdout, None
+
+
+def split_files(stdout):
+    """The files of a run that wrote several to stdout, by path."""
+    parts = FILE_HEADER.split(stdout)
+    return dict(zip(parts[1::2], parts[2::2]))
+
+
+def functions_source(*names):
+    """C source with one function per name, each with an if and a while."""
+    return "".join(f"""int {name}(int x) {{
+    if (x > 1)
+        return 1;
+    while (x < 0)
+        x++;
+    return x;
+}}
+
+""" for name in names)
+
+
+def tree_files(root):
+    """Paths of the files under root, relative to it."""
+    return sorted(os.path.relpath(os.path.join(d, f), root)
+                  for d, _, files in os.walk(root) for f in files)
+
+
+def example_sources(args):
+    return sorted(os.path.join(args.examples, f) for f in os.listdir(args.examples)
+                  if f.endswith(".c"))
+
+
+@check
+def check_jobs(args, work):
+    # two copies of every example, so that the workers finish in a different order than they
+    # start
+    sources = []
+    for copy in ["a", "b"]:
+        os.makedirs(os.path.join(work, copy))
+        for source in example_sources(args):
+            sources.append(shutil.copy(source, os.path.join(work, copy)))
+
+    outputs = {}
+    for jobs in [1, 4]:
+        proc = run_tool(args, sources + [f"-j={jobs}", "--"])
+        if proc.returncode != 0:
+            fail(f"-j={jobs}: exit {proc.returncode}\n{proc.stderr}")
+            return
+        outputs[jobs] = proc.stdout
+    if len(split_files(outputs[1])) != len(sources):
+        fail(f"-j: expected {len(sources)} files on stdout, got {len(split_files(outputs[1]))}")
+    if outputs[1] != outputs[4]:
+        fail("-j: the output with 4 workers differs from the output with 1")
+
+
+@check
+def check_cache(args, work):
+    write_tree(work, {f"src{i}.c": functions_source(f"f{i}") for i in range(3)})
+    sources = [os.path.join(work, f"src{i}.c") for i in range(3)]
+    options = sources + [f"--cache-dir={os.path.join(work, 'cache')}", "--"]
+
+    def cached_run(expected):
+        proc = run_tool(args, options)
+        if proc.returncode != 0:
+            fail(f"--cache-dir: exit {proc.returncode}\n{proc.stderr}")
+            return None
+        if expected not in proc.stderr:
+            fail(f"--cache-dir: expected '{expected}', got\n{proc.stderr}")
+        return split_files(proc.stdout)
+
+    first = cached_run("Cache: 0 hits, 3 misses")
+    replayed = cached_run("Cache: 3 hits, 0 misses")
+    if first is None or replayed is None:
+        return
+    if replayed != first:
+        fail("--cache-dir: the replayed output differs from the parsed one")
+
+    # an edited source is parsed again, the others still replay
+    with open(sources[1], "a") as fp:
+        fp.write(functions_source("added"))
+    edited = cached_run("Cache: 2 hits, 1 misses")
+    if edited is None:
+        return
+    if len(CONDITION_VAR.findall(edited.get(sources[1], ""))) != 4:
+        fail(f"--cache-dir: the edited source was not rewritten again:\n{edited.get(sources[1])}")
+    if any(edited.get(s) != first.get(s) for s in [sources[0], sources[2]]):
+        fail("--cache-dir: the unchanged sources differ after another source was edited")
+
+
+# declarations without a condition, laid out the way clang-format would not lay them out
+EDITS_SOURCES = {
+    "edits.c": """int   untouched( int a ){return a+1;}
+
+int f(int x) {
+    if (x > 1) return 1;
+    return 0;
+}
+
+int  also_untouched (void) { return 2 ; }
+""",
+    "edits.cpp": """namespace ns {
+int   keep( int a ){ return a+1'000; }
+
+int f(int x) {
+    if (x > 1'000)
+        return 1;
+    return 0;
+}
+}  // namespace ns
+""",
+}
+
+EDITS_UNTOUCHED = [
+    "int   untouched( int a ){return a+1;}",
+    "int  also_untouched (void) { return 2 ; }",
+    "int   keep( int a ){ return a+1'000; }",
+]
+
+
+@check
+def check_format_edits(args, work):
+    write_tree(work, EDITS_SOURCES)
+    for name in EDITS_SOURCES:
+        source = os.path.join(work, name)
+        out = os.path.join(work, "out-" + name)
+        proc = run_tool(args, [source, "-o", out, "--format=edits", "--"])
+        if proc.returncode != 0:
+            fail(f"--format=edits {name}: exit {proc.returncode}\n{proc.stderr}")
+            continue
+        code = read(out)
+        if not CONDITION_VAR.search(code):
+            fail(f"--format=edits {name}: the condition was not rewritten:\n{code}")
+        for line in EDITS_UNTOUCHED:
+            if line in EDITS_SOURCES[name] and line not in code:
+                fail(f"--format=edits {name}: untouched declaration was reformatted:\n{code}")
+        cxx = name.endswith(".cpp")
+        error = compile_code(args.cxx if cxx else args.cc, [out], out + ".o",
+                             ["-c"] + (["-std=c++14"] if cxx else []))
+        if error:
+            fail(f"--format=edits {name}: rewritten code does not compile:\n{error}")
+
+
+@check
+def check_examples(args, work):
+    for source in example_sources(args):
+        example = os.path.basename(source)
+        # the examples that print what they compute can be run before and after the rewrite
+        runnable = "#include <stdio.h>" in read(source)
+        if runnable:
+            expected, error = compile_and_run(args.cc, [source], work, "original")
+            if expected is None:
+                fail(f"{example}: does not compile:\n{error}")
+                continue
+
+        for loop, fmt, apply in itertools.product(LOOP_MODES, FORMATS, APPLY):
+            options = [f"--loop-mode={loop}", f"--format={fmt}", f"--apply={apply}"]
+            outputs = {}
+            for engine in ENGINES:
+                name = f"{example}: --engine={engine} " + " ".join(options)
+                out = os.path.join(work, f"{engine}-{loop}-{fmt}-{apply}-{example}")
+                proc = run_tool(args, [source, "-o", out, f"--engine={engine}"] + options + ["--"])
+                if proc.returncode != 0 or "Problem with consuming" in proc.stderr or \
+                        "dropped change" in proc.stderr:
+                    fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+                    continue
+                outputs[engine] = read(out)
+                if not CONDITION_VAR.search(outputs[engine]):
+                    fail(f"{name}: no condition was rewritten")
+                if loop == "inline" and LOOP_BREAK.search(outputs[engine]):
+                    fail(f"{name}: a loop condition was moved into the loop body")
+                if runnable:
+                    actual, error = compile_and_run(args.cc, [out], work, "rewritten")
+                    if actual is None:
+                        fail(f"{name}: rewritten code does not compile:\n{error}")
+                    elif actual != expected:
+                        fail(f"{name}: rewritten program prints something else")
+            # the linear engine keeps insertions at one offset in the order they were produced,
+            # which may differ between the engines; Replacements orders them itself
+            if apply == "replacements" and len(outputs) == len(ENGINES) and \
+                    len(set(outputs.values())) != 1:
+                fail(f"{example}: the engines' outputs differ with " + " ".join(options))
+
+
+# a header shared by two TUs; b.c has a condition before the include, so its counter names for
+# the header's conditions differ from a.c's
+DEDUP_SOURCES = {
+    "inc/shared.h": "#ifndef SHARED_H\n#define SHARED_H\nstatic " + functions_source("shared") +
+                    "#endif\n",
+    "a.c": '#include "shared.h"\n' + functions_source("a"),
+    "b.c": functions_source("b") + '#include "shared.h"\n',
+}
+
+DROPPED = re.compile(r"Dropped (\d+) duplicate and (\d+) conflicting changes")
+
+
+@check
+def check_dedup(args, work):
+    write_tree(work, DEDUP_SOURCES)
+    for naming in ["stable", "counter"]:
+        name = f"dedup --naming={naming}"
+        out = os.path.join(work, "out-" + naming)
+        proc = run_tool(args, [os.path.join(work, "a.c"), os.path.join(work, "b.c"),
+                               f"--naming={naming}", "--header-filter=inc", "--format=none",
+                               f"--source-root={work}", f"--out-dir={out}", "--", "-Iinc"],
+                        cwd=work)
+        if proc.returncode != 0:
+            fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+            continue
+        dropped = DROPPED.search(proc.stderr)
+        duplicates, conflicts = map(int, dropped.groups()) if dropped else (0, 0)
+        # stable names make the TUs' edits to the header identical; counter names do not
+        if naming == "stable" and (duplicates != 2 or conflicts != 0):
+            fail(f"{name}: expected 2 duplicate changes to the header, got\n{proc.stderr}")
+        if naming == "counter" and (duplicates != 0 or conflicts != 2):
+            fail(f"{name}: expected 2 conflicting changes to the header, got\n{proc.stderr}")
+
+        header = os.path.join(out, "inc", "shared.h")
+        if not os.path.exists(header) or len(CONDITION_VAR.findall(read(header))) != 2:
+            fail(f"{name}: the header was not rewritten exactly once")
+            continue
+        for source in ["a.c", "b.c"]:
+            error = compile_code(args.cc, [os.path.join(out, source)],
+                                 os.path.join(out, source + ".o"),
+                                 ["-c", "-I" + os.path.join(out, "inc")])
+            if error:
+                fail(f"{name}: {source} does not compile with the rewritten header:\n{error}")
+
+
+# sources that do not include the prefix headers, so that only --pch ties the cache to them
+PCH_SOURCES = {
+    "prefix.h": "#ifndef PREFIX_H\n#define PREFIX_H\n#include <stdio.h>\n#include <string.h>\n"
+                "#endif\n",
+    "other.h": "#ifndef OTHER_H\n#define OTHER_H\n#include <stdlib.h>\n#endif\n",
+    "p1.c": functions_source("p1"),
+    "p2.c": functions_source("p2"),
+}
+
+
+@check
+def check_pch(args, work):
+    write_tree(work, PCH_SOURCES)
+    sources = [os.path.join(work, "p1.c"), os.path.join(work, "p2.c")]
+    cache = f"--cache-dir={os.path.join(work, 'cache')}"
+
+    def pch_run(name, options, expected=None):
+        proc = run_tool(args, sources + options + ["--"], cwd=work)
+        if proc.returncode != 0:
+            fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+            return None
+        if expected and expected not in proc.stderr:
+            fail(f"{name}: expected '{expected}', got\n{proc.stderr}")
+        return proc.stdout
+
+    plain = pch_run("without --pch", [])
+    with_pch = pch_run("--pch", ["--pch=prefix.h"])
+    if plain is not None and with_pch is not None and plain != with_pch:
+        fail("--pch: the output differs from the output without it")
+
+    # the cache must not replay a result parsed with another prefix header, or with an older
+    # version of this one
+    pch_run("--pch cache", ["--pch=prefix.h", cache], "Cache: 0 hits, 2 misses")
+    pch_run("--pch cache replay", ["--pch=prefix.h", cache], "Cache: 2 hits, 0 misses")
+    pch_run("--pch cache, other header", ["--pch=other.h", cache], "Cache: 0 hits, 2 misses")
+    with open(os.path.join(work, "prefix.h"), "a") as fp:
+        fp.write("#include <stdlib.h>\n")
+    pch_run("--pch cache, edited header", ["--pch=prefix.h", cache], "Cache: 0 hits, 2 misses")
+
+
+# inc2/ shares a prefix with inc, but not a path component
+FILTER_SOURCES = {
+    "inc/h.h": "static " + functions_source("inc_h"),
+    "inc2/h.h": "static " + functions_source("inc2_h"),
+    "other/o.h": "static " + functions_source("other_o"),
+    "main.c": '#include "inc/h.h"\n#include "inc2/h.h"\n#include "other/o.h"\n' +
+              functions_source("main_f"),
+}
+
+
+@check
+def check_header_filter(args, work):
+    src = os.path.join(work, "src")
+    write_tree(src, FILTER_SOURCES)
+    cases = [
+        ([], ["main.c"]),
+        (["--header-filter=inc"], ["inc/h.h", "main.c"]),
+        (["--header-filter=*/other/*.h"], ["main.c", "other/o.h"]),
+        (["--header-filter=inc/,inc2/h.h"], ["inc/h.h", "inc2/h.h", "main.c"]),
+    ]
+    for i, (options, expected) in enumerate(cases):
+        name = " ".join(options) or "without --header-filter"
+        out = os.path.join(work, f"out{i}")
+        proc = run_tool(args, ["main.c", f"--out-dir={out}", "--format=none"] + options +
+                        ["--", "-I."], cwd=src)
+        if proc.returncode != 0:
+            fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+            continue
+        written = tree_files(out)
+        if written != expected:
+            fail(f"{name}: expected {expected} to be rewritten, got {written}")
+        for path in written:
+            if not CONDITION_VAR.search(read(os.path.join(out, path))):
+                fail(f"{name}: {path} was written without being rewritten")
+
+
+PHASES = ["load", "parse", "match", "edits", "consumer", "apply", "write"]
+TU_PHASES = ["parse", "match", "edits", "consumer"]
+
+
+def check_phases(name, phases, expected):
+    if sorted(phases) != sorted(expected):
+        fail(f"{name}: expected phases {expected}, got {sorted(phases)}")
+    for phase, times in phases.items():
+        if not all(isinstance(times.get(t), (int, float)) and times[t] >= 0
+                   for t in ["wall", "cpu"]):
+            fail(f"{name}: phase {phase} has no wall and cpu time: {times}")
+
+
+@check
+def check_stats(args, work):
+    write_tree(work, {"s1.c": functions_source("s1"), "s2.c": functions_source("s2", "s3")})
+    stats_path = os.path.join(work, "stats.json")
+    proc = run_tool(args, ["s1.c", "s2.c", f"--stats={stats_path}", "--"], cwd=work)
+    if proc.returncode != 0:
+        fail(f"--stats: exit {proc.returncode}\n{proc.stderr}")
+        return
+    if not re.search(r"^Phase times: load [0-9.]+s, .* write [0-9.]+s$", proc.stderr, re.M):
+        fail(f"--stats: no phase times on stderr:\n{proc.stderr}")
+    try:
+        stats = json.loads(read(stats_path))
+    except (OSError, ValueError) as e:
+        fail(f"--stats: no JSON report: {e}")
+        return
+
+    expected = {"files": 2, "changes": 6, "failed_changes": 0, "failed_files": 0,
+                "duplicate_changes": 0, "conflicting_changes": 0}
+    for key, value in expected.items():
+        if stats.get(key) != value:
+            fail(f"--stats: expected {key} {value}, got {stats.get(key)}")
+    check_phases("--stats", stats.get("phases", {}), PHASES)
+    rules = stats.get("rules", {})
+    if rules.get("if_rule") != 3 or rules.get("while_rule_single") != 3 or \
+            sum(rules.values()) != 6:
+        fail(f"--stats: expected 3 if_rule and 3 while_rule_single matches, got {rules}")
+    if sorted(stats.get("edits_per_file", {}).values()) != [2, 4]:
+        fail(f"--stats: expected 2 and 4 edits per file, got {stats.get('edits_per_file')}")
+    tus = stats.get("tus", {})
+    if sorted(tu.get("changes") for tu in tus.values()) != [2, 4]:
+        fail(f"--stats: expected TUs with 2 and 4 changes, got {tus}")
+    for path, tu in tus.items():
+        check_phases(f"--stats TU {path}", tu.get("phases", {}), TU_PHASES)
+
+
+@check
+def check_export_fixes(args, work):
+    # two sources with the same name, which must not share a YAML file
+    sources = {"x/s.c": functions_source("x"), "y/s.c": functions_source("y")}
+    write_tree(work, sources)
+    fixes = os.path.join(work, "fixes")
+    proc = run_tool(args, sorted(sources) + [f"--export-fixes-dir={fixes}", "--"], cwd=work)
+    if proc.returncode != 0:
+        fail(f"--export-fixes-dir: exit {proc.returncode}\n{proc.stderr}")
+        return
+    if f"Exported 4 changes to {fixes}" not in proc.stderr:
+        fail(f"--export-fixes-dir: expected 4 exported changes, got\n{proc.stderr}")
+    for name, code in sources.items():
+        if read(os.path.join(work, name)) != code:
+            fail(f"--export-fixes-dir: {name} was rewritten instead of exported")
+
+    exported = tree_files(fixes)
+    if len(exported) != 2 or not all(re.match(r"s\.c-[0-9A-F]+\.yaml$", f) for f in exported):
+        fail(f"--export-fixes-dir: expected two s.c-<hash>.yaml files, got {exported}")
+        return
+    for name in exported:
+        yaml = read(os.path.join(fixes, name))
+        if "MainSourceFile:" not in yaml or yaml.count("ReplacementText:") < 2:
+            fail(f"--export-fixes-dir: {name} lacks the source or its replacements:\n{yaml}")
+
+    if not args.apply_replacements:
+        print("  skipped applying the fixes: clang-apply-replacements not found", file=sys.stderr)
+        return
+    proc = subprocess.run([args.apply_replacements, fixes], stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT, text=True)
+    if proc.returncode != 0:
+        fail(f"--export-fixes-dir: clang-apply-replacements failed:\n{proc.stdout}")
+        return
+    for name in sources:
+        path = os.path.join(work, name)
+        if len(CONDITION_VAR.findall(read(path))) != 2:
+            fail(f"--export-fixes-dir: {name} is not rewritten after applying the fixes")
+        error = compile_code(args.cc, [path], path + ".o", ["-c"])
+        if error:
+            fail(f"--export-fixes-dir: {name} does not compile after applying the fixes:\n{error}")
+
+
+def check_reply(name, reply, source):
+    if "error" in reply:
+        fail(f"{name}: {reply['error']}")
+        return
+    if reply.get("file") != source or reply.get("changes") != 2:
+        fail(f"{name}: unexpected reply {reply}")
+        return
+    entries = [f for f in reply.get("files", []) if f.get("path") == source]
+    if len(entries) != 1 or len(CONDITION_VAR.findall(entries[0].get("code", ""))) != 2:
+        fail(f"{name}: the rewritten source is missing from {reply}")
+
+
+@check
+def check_serve(args, work):
+    source = os.path.join(work, "served.c")
+    write_tree(work, {"served.c": functions_source("served")})
+    out = os.path.join(work, "out.c")
+    requests = [
+        {"file": source},
+        "not json",
+        {"out": out},
+        {"file": source, "out": out, "refresh": True},
+    ]
+    lines = "".join((r if isinstance(r, str) else json.dumps(r)) + "\n" for r in requests)
+    proc = run_tool(args, ["--serve", "--"], input=lines)
+    replies = [json.loads(line) for line in proc.stdout.splitlines()]
+    if proc.returncode != 0 or len(replies) != len(requests):
+        fail(f"--serve: exit {proc.returncode}, {len(replies)} replies\n{proc.stderr}")
+        return
+    check_reply("--serve", replies[0], source)
+    if "error" not in replies[1] or "error" not in replies[2]:
+        fail(f"--serve: malformed requests were not answered with an error: {replies[1:3]}")
+    entries = replies[3].get("files", [])
+    if not entries or entries[0].get("out") != out or "code" in entries[0] or \
+            not os.path.exists(out) or len(CONDITION_VAR.findall(read(out))) != 2:
+        fail(f"--serve: the source was not written to out: {replies[3]}")
+
+
+@check
+def check_serve_socket(args, work):
+    source = os.path.join(work, "served.c")
+    write_tree(work, {"served.c": functions_source("served")})
+    path = os.path.join(work, "serve.sock")
+    server = subprocess.Popen([args.tool, f"--serve-socket={path}", "--"],
+                              stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    try:
+        for _ in range(300):
+            if os.path.exists(path) or server.poll() is not None:
+                break
+            time.sleep(0.1)
+        if not os.path.exists(path):
+            fail("--serve-socket: the socket was not created")
+            return
+        request = (json.dumps({"file": source}) + "\n").encode()
+        # a client that goes away before its reply must not take the server down
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as client:
+            client.connect(path)
+            client.sendall(request)
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as client:
+            client.settimeout(120)
+            client.connect(path)
+            client.sendall(request)
+            client.shutdown(socket.SHUT_WR)
+            data = b""
+            while not data.endswith(b"\n"):
+                chunk = client.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+        if not data:
+            fail("--serve-socket: no reply after a client disconnected\n" +
+                 (server.stderr.read() if server.poll() is not None else ""))
+            return
+        check_reply("--serve-socket", json.loads(data), source)
+    finally:
+        server.terminate()
+        server.wait()
+
+
+@check
+def check_shard(args, work):
+    src = os.path.join(work, "src")
+    # sources of different sizes, all including one header
+    files = {"inc/common.h": "static " + functions_source("common")}
+    for i in range(5):
+        files[f"s{i}.c"] = '#include "inc/common.h"\n' + \
+            functions_source(*(f"s{i}_{j}" for j in range(i + 1)))
+    write_tree(src, files)
+    sources = sorted(f for f in files if f.endswith(".c"))
+
+    def sharded_run(name, out, options):
+        proc = run_tool(args, sources + [f"--out-dir={out}", "--header-filter=inc"] + options +
+                        ["--", "-I."], cwd=src)
+        if proc.returncode != 0:
+            fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+            return None
+        return {f: read(os.path.join(out, f)) for f in tree_files(out)}
+
+    full = sharded_run("--naming=stable", os.path.join(work, "full"), ["--naming=stable"])
+    shards = [sharded_run(f"--shard={i}/3", os.path.join(work, f"shard{i}"), [f"--shard={i}/3"])
+              for i in range(3)]
+    if full is None or None in shards:
+        return
+    for source in sources:
+        owners = [i for i, shard in enumerate(shards) if source in shard]
+        if len(owners) != 1:
+            fail(f"--shard: {source} is in shards {owners}, not in exactly one")
+    merged = {}
+    for shard in shards:
+        for path, code in shard.items():
+            if merged.setdefault(path, code) != code:
+                fail(f"--shard: the shards rewrite {path} differently")
+    if merged != full:
+        fail("--shard: the shards' outputs together differ from the output of one run")
+
+
+HOOK_CALL = re.compile(r"\b__fuzzfix_cond\(0x[0-9a-f]{8}u,")
+
+
+@check
+def check_hook(args, work):
+    # without a segment id, the runtime keeps its table in process memory
+    env = {k: v for k, v in os.environ.items() if k != "__FUZZFIX_SHM_ID"}
+    runtime = [os.path.join(args.runtime, "fuzzfix_rt.c")]
+    flags = ["-I" + args.runtime, "-lpthread"]
+    for source in example_sources(args):
+        example = os.path.basename(source)
+        if "#include <stdio.h>" not in read(source):
+            continue
+        expected, error = compile_and_run(args.cc, [source], work, "original")
+        if expected is None:
+            fail(f"{example}: does not compile:\n{error}")
+            continue
+        for engine in ENGINES:
+            name = f"{example}: --capture=hook --engine={engine}"
+            out = os.path.join(work, f"hook-{engine}-{example}")
+            site_map = out + ".sites"
+            proc = run_tool(args, [source, "-o", out, "--capture=hook", f"--site-map={site_map}",
+                                   f"--engine={engine}", "--"])
+            if proc.returncode != 0 or "Problem with consuming" in proc.stderr:
+                fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+                continue
+            code = read(out)
+            calls = len(HOOK_CALL.findall(code))
+            if not calls or CONDITION_VAR.search(code):
+                fail(f"{name}: the conditions are not all hooked:\n{code}")
+            sites = read(site_map).splitlines() if os.path.exists(site_map) else []
+            if len(sites) != calls:
+                fail(f"{name}: {calls} hooks, but {len(sites)} lines in the site map")
+            actual, error = compile_and_run(args.cc, [out] + runtime, work, "hooked", flags, env)
+            if actual is None:
+                fail(f"{name}: rewritten code does not compile with the runtime:\n{error}")
+            elif actual != expected:
+                fail(f"{name}: rewritten program prints something else")
+
+
+FUNCTIONS_SOURCE = "namespace proto {\n" + functions_source("parse") + "}\n" + \
+    functions_source("h1", "h12", "h1234", "other")
+FUNCTION_BODY = re.compile(r"^int (\w+)\(int x\) \{\n(.*?)^\}", re.M | re.S)
+
+
+@check
+def check_functions(args, work):
+    source = os.path.join(work, "functions.cpp")
+    write_tree(work, {"functions.cpp": FUNCTIONS_SOURCE})
+    cases = [
+        # the comma is part of the regex, not a separator
+        (["--functions-include=re:h[0-9]{1,3}"], ["h1", "h12"]),
+        (["--functions-include=h1*"], ["h1", "h12", "h1234"]),
+        (["--functions-include=h1*", "--functions-exclude=h12*"], ["h1"]),
+        (["--functions-exclude=proto::*"], ["h1", "h12", "h1234", "other"]),
+        (["--functions-include=proto::*", "--functions-include=other"], ["other", "parse"]),
+    ]
+    for i, (options, expected) in enumerate(cases):
+        name = " ".join(options)
+        out = os.path.join(work, f"out{i}.cpp")
+        proc = run_tool(args, [source, "-o", out, "--format=none"] + options + ["--"])
+        if proc.returncode != 0:
+            fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+            continue
+        rewritten = sorted(f for f, body in FUNCTION_BODY.findall(read(out))
+                           if CONDITION_VAR.search(body))
+        if rewritten != expected:
+            fail(f"{name}: expected {expected} to be rewritten, got {rewritten}")
+
+
+# conditions of functions_source("hot", "cold"): the if of hot is on line 2, its while on line
+# 4, the if of cold on line 10 and its while on line 12
+PROFILES = {
+    "lcov.info": ([], "SF:prog.c\nDA:2,5000000\nDA:4,2000000\nDA:10,3\nDA:12,0\nend_of_record\n",
+                  {"hot": (True, True), "cold": (False, False)}),
+    "prog.c.gcov": (["--hot-threshold=100"],
+                    "        -:    0:Source:prog.c\n    5000*:    2:    if (x > 1)\n"
+                    "       50:    4:    while (x < 0)\n    #####:   10:    if (x > 1)\n"
+                    "      150:   12:    while (x < 0)\n",
+                    {"hot": (True, False), "cold": (False, True)}),
+}
+
+
+@check
+def check_profile(args, work):
+    write_tree(work, {"prog.c": functions_source("hot", "cold")})
+    for profile, (options, data, expected) in PROFILES.items():
+        write_tree(work, {profile: data})
+        name = f"--profile={profile}"
+        out = os.path.join(work, "out-" + profile + ".c")
+        stats_path = os.path.join(work, profile + ".json")
+        proc = run_tool(args, ["prog.c", "-o", out, f"--profile={profile}", "--format=none",
+                               f"--stats={stats_path}"] + options + ["--"], cwd=work)
+        if proc.returncode != 0:
+            fail(f"{name}: exit {proc.returncode}\n{proc.stderr}")
+            continue
+        # whether the if and the while of each function are left as they were
+        kept = {f: ("if (x > 1)" in body, "while (x < 0)" in body)
+                for f, body in FUNCTION_BODY.findall(read(out))}
+        if kept != expected:
+            fail(f"{name}: expected (if, while) kept as {expected}, got {kept}")
+        hot = json.loads(read(stats_path)).get("hot_conditions") \
+            if os.path.exists(stats_path) else None
+        if hot != 2:
+            fail(f"{name}: expected 2 hot conditions in --stats, got {hot}")
+
+
+DIFF_SOURCES = {
+    "modified.c": """int f(int x) {
+    if (x > 1)
+        return 1;
+    if (x < -1)
+        return 2;
+    return 0;
+}
+""",
+    "added.c": """int g(int y) {
+    while (y > 0)
+        y--;
+    return y;
+}
+""",
+    "untouched.c": """int h(int z) {
+    if (z == 3)
+        return 1;
+    return 0;
+}
+""",
+}
+
+# git diff -U0 of: the second if of modified.c changed, added.c added, deleted.c deleted
+DIFF = """diff --git a/modified.c b/modified.c
+index 1111111..2222222 100644
+--- a/modified.c
++++ b/modified.c
+@@ -4 +4 @@ int f(int x) {
+-    if (x < -2)
++    if (x < -1)
+diff --git a/added.c b/added.c
+new file mode 100644
+index 0000000..3333333
+--- /dev/null
++++ b/added.c
+@@ -0,0 +1,5 @@
++int g(int y) {
++    while (y > 0)
++        y--;
++    return y;
++}
+diff --git a/deleted.c b/deleted.c
+deleted file mode 100644
+index 4444444..0000000
+--- a/deleted.c
++++ /dev/null
+@@ -1,3 +0,0 @@
+-int k(int w) {
+-    return w ? 1 : 0;
+-}
+"""
+
+
+@check
+def check_diff(args, work):
+    src = os.path.join(work, "src")
+    out = os.path.join(work, "out")
+    write_tree(src, DIFF_SOURCES)
+    diff = os.path.join(work, "changes.diff")
+    write_tree(work, {"changes.diff": DIFF})
+
+    proc = run_tool(args, sorted(DIFF_SOURCES) + [f"--diff={diff}", f"--out-dir={out}",
+                                                  "--format=none", "--"], cwd=src)
+    if proc.returncode != 0:
+        fail(f"--diff: exit {proc.returncode}\n{proc.stderr}")
+        return
+    if "Parsing 2 of 3 sources touched by the diff" not in proc.stderr:
+        fail(f"--diff: expected modified.c and added.c to be parsed, got\n{proc.stderr}")
+
+    def rewritten(name):
+        path = os.path.join(out, name)
+        return read(path) if os.path.exists(path) else DIFF_SOURCES[name]
+
+    modified = rewritten("modified.c")
+    if len(CONDITION_VAR.findall(modified)) != 1 or "if (x > 1)" not in modified:
+        fail(f"--diff: only the changed condition of modified.c should be rewritten:\n{modified}")
+    if not CONDITION_VAR.search(rewritten("added.c")):
+        fail("--diff: the condition of the added file was not rewritten")
+    if rewritten("untouched.c") != DIFF_SOURCES["untouched.c"]:
+        fail("--diff: untouched.c was rewritten")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--tool", required=True, help="rewritecond executable")
+    parser.add_argument("--examples", default="examples", help="directory of example sources")
+    parser.add_argument("--runtime", default="runtime",
+                        help="directory of the --capture=hook runtime")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"), help="C compiler")
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "c++"), help="C++ compiler")
+    parser.add_argument("--apply-replacements", default="clang-apply-replacements",
+                        help="clang-apply-replacements, to apply exported fixes; the one on "
+                             "PATH if this one does not exist")
+    parser.add_argument("--only", action="append", default=[],
+                        help="run only this check (e.g. jobs); may be repeated")
+    args = parser.parse_args()
+    args.tool = os.path.abspath(args.tool)
+    args.examples = os.path.abspath(args.examples)
+    args.runtime = os.path.abspath(args.runtime)
+    args.apply_replacements = shutil.which(args.apply_replacements) or \
+        shutil.which("clang-apply-replacements")
+
+    names = [c.__name__[len("check_"):] for c in CHECKS]
+    unknown = set(args.only) - set(names)
+    if unknown:
+        parser.error("unknown check " + ", ".join(sorted(unknown)) + "; known: " +
+                     ", ".join(names))
+
+    # real path, as the tool prints normalized absolute paths
+    work = os.path.realpath(tempfile.mkdtemp(prefix="rewritecond-check-"))
+    try:
+        for func, name in zip(CHECKS, names):
+            if args.only and name not in args.only:
+                continue
+            print(f"check {name}", file=sys.stderr)
+            scratch = os.path.join(work, name)
+            os.makedirs(scratch)
+            func(args, scratch)
+    finally:
+        shutil.rmtree(work)
+
+    if failures:
+        print(f"{len(failures)} failures", file=sys.stderr)
+        sys.exit(1)
+    print("all checks passed", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()